@@ -0,0 +1,102 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <cuckoomap/CuckooFilter.h>
+
+#include "MicroBenchmark.h"
+
+struct Key {
+  uint64_t k;
+  Key() : k(0) {}
+  Key(uint64_t i) : k(i) {}
+  bool empty() { return k == 0; }
+};
+
+namespace std {
+
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+static constexpr uint64_t Capacity = 1 << 20;
+
+// Fills the filter with random odd keys up to the given load factor (or
+// until it refuses to take more) and returns the inserted keys:
+static std::vector<Key> fill(CuckooFilter<Key>& filter, double load,
+                             uint64_t& rand) {
+  std::vector<Key> keys;
+  while (filter.nrUsed() < load * filter.capacity() &&
+         keys.size() < 2 * filter.capacity()) {
+    Key k(benchmarkRandom(rand) | 1);
+    filter.insert(k);
+    keys.push_back(k);
+  }
+  return keys;
+}
+
+static std::string loadName(double load) {
+  return std::to_string(static_cast<int>(load * 100 + 0.5));
+}
+
+static void registerFilter(double load) {
+  registerBenchmark(
+      "CuckooFilter/lookupHit/load:" + loadName(load),
+      [load](BenchmarkState& state) {
+        CuckooFilter<Key> filter(Capacity);
+        uint64_t rand = 1;
+        std::vector<Key> keys = fill(filter, load, rand);
+        while (state.keepRunning()) {
+          doNotOptimize(filter.lookup(keys[state.iterations() % keys.size()]));
+        }
+      });
+
+  registerBenchmark("CuckooFilter/lookupMiss/load:" + loadName(load),
+                    [load](BenchmarkState& state) {
+                      CuckooFilter<Key> filter(Capacity);
+                      uint64_t rand = 1;
+                      fill(filter, load, rand);
+                      while (state.keepRunning()) {
+                        // Even keys have never been inserted:
+                        Key k(benchmarkRandom(rand) & ~1ULL);
+                        doNotOptimize(filter.lookup(k));
+                      }
+                    });
+
+  // Inserts batches of fresh keys and removes them again untimed, such
+  // that the load factor stays within 1% of the nominal one:
+  registerBenchmark(
+      "CuckooFilter/insert/load:" + loadName(load),
+      [load](BenchmarkState& state) {
+        CuckooFilter<Key> filter(Capacity);
+        uint64_t rand = 1;
+        fill(filter, load, rand);
+        std::vector<Key> batch(Capacity / 100);
+        for (auto& k : batch) {
+          k = Key(benchmarkRandom(rand) | 1);
+        }
+        size_t next = 0;
+        while (state.keepRunning()) {
+          if (next == batch.size()) {
+            state.pauseTiming();
+            for (auto& k : batch) {
+              filter.remove(k);
+              k = Key(benchmarkRandom(rand) | 1);
+            }
+            next = 0;
+            state.resumeTiming();
+          }
+          filter.insert(batch[next++]);
+        }
+      });
+}
+
+int main(int argc, char* argv[]) {
+  double loads[] = {0.25, 0.5, 0.75, 0.9};
+  for (double load : loads) {
+    registerFilter(load);
+  }
+  return runBenchmarks(argc, argv);
+}
@@ -0,0 +1,263 @@
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cuckoomap/CuckooHashes.h>
+#include <cuckoomap/CuckooMap.h>
+
+#include "MicroBenchmark.h"
+
+struct Key {
+  uint64_t k;
+  Key() : k(0) {}
+  Key(uint64_t i) : k(i) {}
+  bool empty() { return k == 0; }
+};
+
+namespace std {
+
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+struct Value {
+  uint64_t v;
+};
+
+typedef CuckooMap<Key, Value> Map;
+// Hashed by the vectorized kernel in lookupCopyBatch:
+typedef CuckooMap<Key, Value, SplitHash1<BatchHash<Key, 1>>,
+                  SplitHash2<BatchHash<Key, 1>>>
+    BatchMap;
+
+static constexpr uint64_t FirstSize = 1024;
+
+// A 64-byte key, whose hashing costs more than its buckets:
+struct WideKey {
+  uint64_t k[8];
+  WideKey() : k() {}
+  explicit WideKey(uint64_t i) : k() { k[0] = i; }
+  bool empty() { return k[0] == 0; }
+};
+
+namespace std {
+
+template <>
+struct equal_to<WideKey> {
+  bool operator()(WideKey const& a, WideKey const& b) const {
+    return a.k[0] == b.k[0];
+  }
+};
+}
+
+typedef CuckooMap<WideKey, Value> WideMap;
+typedef CuckooMap<WideKey, Value, HashWithSeed<WideKey, 0xdeadbeefdeadbeefULL>,
+                  HashWithSeed<WideKey, 0xabcdefabcdef1234ULL>,
+                  std::equal_to<WideKey>, 2, true>
+    TaggedWideMap;
+
+// Fills fresh maps with Keys keys at a time, the pairs expunged on the way
+// are hashed again unless the map stores tags:
+template <class M>
+static void runWideInserts(BenchmarkState& state) {
+  static constexpr uint64_t Keys = 1 << 16;
+  std::unique_ptr<M> map(new M(FirstSize));
+  Value v;
+  uint64_t next = 1;
+  while (state.keepRunning()) {
+    if (next > Keys) {
+      state.pauseTiming();
+      map.reset(new M(FirstSize));
+      next = 1;
+      state.resumeTiming();
+    }
+    v.v = next;
+    map->insert(WideKey(next++), &v);
+  }
+}
+
+// Returns the number of keys 1, 2, 3, ... after which a map has the
+// given number of layers for the last time. The map is deterministic, so
+// a fresh map filled with the same keys has the same shape.
+template <class M = Map>
+static uint64_t keysForLayers(uint32_t layers) {
+  M map(FirstSize);
+  Value v;
+  uint64_t n = 0;
+  while (map.nrLayers() <= layers) {
+    ++n;
+    v.v = n;
+    map.insert(Key(n), &v);
+  }
+  return n - 1;
+}
+
+template <class M>
+static void runLookupCopyBatch(BenchmarkState& state, uint32_t layers) {
+  static constexpr uint64_t Batch = 64;
+  uint64_t n = keysForLayers<M>(layers);
+  M map(FirstSize);
+  Value v;
+  for (uint64_t i = 1; i <= n; ++i) {
+    v.v = i;
+    map.insert(Key(i), &v);
+  }
+  uint64_t rand = 1;
+  Key keys[Batch];
+  Value values[Batch];
+  bool found[Batch];
+  state.setItemsPerIteration(Batch);
+  while (state.keepRunning()) {
+    for (uint64_t i = 0; i < Batch; ++i) {
+      keys[i] = Key(1 + benchmarkRandom(rand) % n);
+    }
+    doNotOptimize(map.lookupCopyBatch(keys, Batch, values, found));
+  }
+}
+
+static void registerMap(uint32_t layers) {
+  // The keys are spread over all layers, note that a lookup hit
+  // promotes its pair to the first layer:
+  registerBenchmark("CuckooMap/lookupHit/layers:" + std::to_string(layers),
+                    [layers](BenchmarkState& state) {
+                      uint64_t n = keysForLayers(layers);
+                      Map map(FirstSize);
+                      Value v;
+                      for (uint64_t i = 1; i <= n; ++i) {
+                        v.v = i;
+                        map.insert(Key(i), &v);
+                      }
+                      uint64_t rand = 1;
+                      while (state.keepRunning()) {
+                        Key k(1 + benchmarkRandom(rand) % n);
+                        auto f = map.lookup(k);
+                        doNotOptimize(f.value());
+                      }
+                    });
+
+  // The same keys, each prefetched a few lookups ahead:
+  registerBenchmark(
+      "CuckooMap/lookupHitPrefetch/layers:" + std::to_string(layers),
+      [layers](BenchmarkState& state) {
+        static constexpr uint64_t Distance = 8;
+        uint64_t n = keysForLayers(layers);
+        Map map(FirstSize);
+        Value v;
+        for (uint64_t i = 1; i <= n; ++i) {
+          v.v = i;
+          map.insert(Key(i), &v);
+        }
+        uint64_t rand = 1;
+        Key ahead[Distance];
+        for (uint64_t i = 0; i < Distance; ++i) {
+          ahead[i] = Key(1 + benchmarkRandom(rand) % n);
+          map.prefetch(ahead[i]);
+        }
+        while (state.keepRunning()) {
+          uint64_t next = state.iterations() % Distance;
+          auto f = map.lookup(ahead[next]);
+          doNotOptimize(f.value());
+          ahead[next] = Key(1 + benchmarkRandom(rand) % n);
+          map.prefetch(ahead[next]);
+        }
+      });
+
+  // Lock-free lookups of 64 keys one after the other, and interleaved
+  // with coroutines (which needs C++20, make CXXSTD=c++20). Neither
+  // promotes, so the pairs stay spread over all layers. These maps fit
+  // into the caches, so interleaving only shows its overhead here, it
+  // pays off once the lookups miss the last level cache:
+  registerBenchmark(
+      "CuckooMap/lookupCopy/layers:" + std::to_string(layers),
+      [layers](BenchmarkState& state) {
+        static constexpr uint64_t Batch = 64;
+        uint64_t n = keysForLayers(layers);
+        Map map(FirstSize);
+        Value v;
+        for (uint64_t i = 1; i <= n; ++i) {
+          v.v = i;
+          map.insert(Key(i), &v);
+        }
+        uint64_t rand = 1;
+        Key keys[Batch];
+        state.setItemsPerIteration(Batch);
+        while (state.keepRunning()) {
+          for (uint64_t i = 0; i < Batch; ++i) {
+            keys[i] = Key(1 + benchmarkRandom(rand) % n);
+          }
+          for (uint64_t i = 0; i < Batch; ++i) {
+            doNotOptimize(map.lookupCopy(keys[i], &v));
+          }
+        }
+      });
+
+  // The same in batches, with the default hashes one by one and with
+  // BatchHash vectorized:
+  registerBenchmark(
+      "CuckooMap/lookupCopyBatch/layers:" + std::to_string(layers),
+      [layers](BenchmarkState& state) {
+        runLookupCopyBatch<Map>(state, layers);
+      });
+  registerBenchmark(
+      "CuckooMap/lookupCopyBatchHash/layers:" + std::to_string(layers),
+      [layers](BenchmarkState& state) {
+        runLookupCopyBatch<BatchMap>(state, layers);
+      });
+
+#if CUCKOO_MAP_COROUTINES
+  registerBenchmark(
+      "CuckooMap/lookupInterleaved/layers:" + std::to_string(layers),
+      [layers](BenchmarkState& state) {
+        static constexpr uint64_t Batch = 64;
+        uint64_t n = keysForLayers(layers);
+        Map map(FirstSize);
+        Value v;
+        for (uint64_t i = 1; i <= n; ++i) {
+          v.v = i;
+          map.insert(Key(i), &v);
+        }
+        uint64_t rand = 1;
+        Key keys[Batch];
+        Value values[Batch];
+        bool found[Batch];
+        state.setItemsPerIteration(Batch);
+        while (state.keepRunning()) {
+          for (uint64_t i = 0; i < Batch; ++i) {
+            keys[i] = Key(1 + benchmarkRandom(rand) % n);
+          }
+          doNotOptimize(
+              interleavedLookups(map, keys, Batch, values, found, 8));
+        }
+      });
+#endif
+
+  registerBenchmark("CuckooMap/lookupMiss/layers:" + std::to_string(layers),
+                    [layers](BenchmarkState& state) {
+                      uint64_t n = keysForLayers(layers);
+                      Map map(FirstSize);
+                      Value v;
+                      for (uint64_t i = 1; i <= n; ++i) {
+                        v.v = i;
+                        map.insert(Key(i), &v);
+                      }
+                      uint64_t rand = 1;
+                      while (state.keepRunning()) {
+                        Key k(n + 1 + (benchmarkRandom(rand) >> 1));
+                        auto f = map.lookup(k);
+                        doNotOptimize(f.found());
+                      }
+                    });
+}
+
+int main(int argc, char* argv[]) {
+  for (uint32_t layers = 1; layers <= 5; ++layers) {
+    registerMap(layers);
+  }
+  registerBenchmark("CuckooMap/insertWide", &runWideInserts<WideMap>);
+  registerBenchmark("CuckooMap/insertWideTagged",
+                    &runWideInserts<TaggedWideMap>);
+  return runBenchmarks(argc, argv);
+}
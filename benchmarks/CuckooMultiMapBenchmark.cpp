@@ -0,0 +1,65 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <cuckoomap/CuckooMultiMap.h>
+
+#include "MicroBenchmark.h"
+
+struct Key {
+  uint64_t k;
+  Key() : k(0) {}
+  Key(uint64_t i) : k(i) {}
+};
+
+namespace std {
+
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+struct Value {
+  uint64_t v;
+};
+
+typedef CuckooMultiMap<Key, Value> Map;
+
+static constexpr uint64_t NrPairs = 1 << 16;
+
+// Looks up a random key and iterates over all pairs with that key, the
+// time per item is the time per visited pair:
+static void registerIteration(uint32_t multiplicity) {
+  registerBenchmark(
+      "CuckooMultiMap/iterate/multiplicity:" + std::to_string(multiplicity),
+      [multiplicity](BenchmarkState& state) {
+        uint64_t nrKeys = NrPairs / multiplicity;
+        Map map(1024);
+        Value v;
+        for (uint64_t i = 1; i <= nrKeys; ++i) {
+          for (uint32_t j = 0; j < multiplicity; ++j) {
+            v.v = j;
+            map.insert(Key(i), &v);
+          }
+        }
+        uint64_t rand = 1;
+        state.setItemsPerIteration(multiplicity);
+        while (state.keepRunning()) {
+          auto f = map.lookup(Key(1 + benchmarkRandom(rand) % nrKeys));
+          if (f.found()) {
+            do {
+              doNotOptimize(f.value()->v);
+            } while (f.next());
+          }
+        }
+      });
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t multiplicities[] = {1, 4, 16, 64};
+  for (uint32_t m : multiplicities) {
+    registerIteration(m);
+  }
+  return runBenchmarks(argc, argv);
+}
@@ -0,0 +1,369 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cuckoomap/CuckooMap.h>
+#include <cuckoomap/ShardedMap.h>
+
+#include "../tests/LatencyHistogram.h"
+#include "../tests/WorkloadGenerators.h"
+#include "MicroBenchmark.h"
+
+// Replays a workload trace (as written by PerformanceTest --record) against
+// a grid of ShardedMap<CuckooMap> configurations and reports the Pareto
+// front of throughput, p99 latency and memory: a configuration is on the
+// front if no other one is at least as good in all three and better in
+// one. Memory is measured at the end of the replay, which is not the peak
+// if emptied last layers were retired meanwhile. Every thread replays the
+// whole trace in its own key range, as PerformanceTest --trace does, so
+// that the shard count matters.
+//
+// Usage: CuckooTuner [--trace=FILE] [--threads=N] [--first-size=LIST]
+//          [--growth=LIST] [--slots=LIST] [--promotion=LIST]
+//          [--shards=LIST] [--all] [--csv]
+//   --trace=FILE: trace to replay, without it a synthetic trace of
+//                 200000 operations (30% inserts, Zipfian lookups, 5%
+//                 misses) is used
+//   --threads=N: number of replaying threads (default 1)
+//   LISTs are comma separated, the defaults are
+//     --first-size=256,4096,65536   size of the first layer per shard
+//     --growth=2,4,8                size ratio of consecutive layers
+//     --slots=2,4,8                 slots per bucket, out of 1 ... 16
+//     --promotion=always,never      promotion of lookup hits
+//     --shards=1,4,16               number of shards
+//   --all: print all configurations, not only the Pareto front
+//   --csv: print CSV instead of a table
+
+struct Key {
+  uint64_t k;
+  Key() : k(0) {}
+  Key(uint64_t i) : k(i) {}
+  bool empty() { return k == 0; }
+};
+
+namespace std {
+
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+struct Value {
+  uint64_t v;
+};
+
+struct Config {
+  uint64_t firstSize;
+  uint32_t growth;
+  uint32_t slots;
+  CuckooMapPolicy::Promotion promotion;
+  uint32_t shards;
+};
+
+struct Result {
+  Config config;
+  double opsPerSecond;
+  uint64_t p99;  // nanoseconds, over all operations
+  uint64_t memory;  // bytes at the end of the replay
+  bool pareto;
+};
+
+template <uint32_t Slots>
+using TunedMap = ShardedMap<
+    CuckooMap<Key, Value, HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+              HashWithSeed<Key, 0xabcdefabcdef1234ULL>, std::equal_to<Key>,
+              Slots>>;
+
+template <uint32_t Slots>
+void replay(Config const& c, std::vector<TraceRecord> const& trace,
+            unsigned nThreads, Result& result) {
+  CuckooMapPolicy policy;
+  policy.growthFactor = c.growth;
+  policy.promotion = c.promotion;
+  TunedMap<Slots> map(c.firstSize, c.shards, sizeof(Value), alignof(Value),
+                      policy);
+  std::vector<LatencyHistogram> histograms(nThreads);
+  std::vector<std::thread> threads;
+  auto begin = std::chrono::steady_clock::now();
+  for (unsigned t = 0; t < nThreads; ++t) {
+    threads.emplace_back([&map, &trace, &histograms, t]() {
+      // Trace keys are 32 bit, so every thread gets its own upper half:
+      uint64_t base = (static_cast<uint64_t>(t) << 32) + 1;
+      LatencyHistogram& h = histograms[t];
+      Value v;
+      for (TraceRecord const& r : trace) {
+        Key k(base + r.key);
+        uint64_t start = latencyClock();
+        switch (r.op) {
+          case 0:
+            v.v = r.key;
+            map.insert(k, &v);
+            break;
+          case 1: {
+            auto f = map.lookup(k);
+            doNotOptimize(f.found());
+            break;
+          }
+          default:
+            map.remove(k);
+            break;
+        }
+        h.record(latencyClock() - start);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  for (unsigned t = 1; t < nThreads; ++t) {
+    histograms[0].merge(histograms[t]);
+  }
+  double seconds = std::chrono::duration<double>(end - begin).count();
+  result.config = c;
+  result.opsPerSecond = static_cast<double>(trace.size()) * nThreads / seconds;
+  result.p99 = histograms[0].percentile(0.99);
+  result.memory = map.memoryUsage();
+  result.pareto = false;
+}
+
+// Selects the compiled-in instantiation for the slots per bucket:
+bool dispatch(Config const& c, std::vector<TraceRecord> const& trace,
+              unsigned nThreads, Result& result) {
+  switch (c.slots) {
+    case 1:
+      replay<1>(c, trace, nThreads, result);
+      return true;
+    case 2:
+      replay<2>(c, trace, nThreads, result);
+      return true;
+    case 4:
+      replay<4>(c, trace, nThreads, result);
+      return true;
+    case 8:
+      replay<8>(c, trace, nThreads, result);
+      return true;
+    case 16:
+      replay<16>(c, trace, nThreads, result);
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool dominates(Result const& a, Result const& b) {
+  bool noWorse = a.opsPerSecond >= b.opsPerSecond && a.p99 <= b.p99 &&
+                 a.memory <= b.memory;
+  bool better = a.opsPerSecond > b.opsPerSecond || a.p99 < b.p99 ||
+                a.memory < b.memory;
+  return noWorse && better;
+}
+
+void markParetoFront(std::vector<Result>& results) {
+  for (Result& r : results) {
+    r.pareto = true;
+    for (Result const& other : results) {
+      if (dominates(other, r)) {
+        r.pareto = false;
+        break;
+      }
+    }
+  }
+}
+
+std::vector<TraceRecord> syntheticTrace() {
+  static constexpr uint32_t NrOps = 200000;
+  std::vector<TraceRecord> trace;
+  ZipfianGenerator zipf(0.99);
+  uint64_t rand = 1;
+  uint32_t nrKeys = 0;
+  for (uint32_t i = 0; i < NrOps; ++i) {
+    TraceRecord r;
+    uint64_t choice = benchmarkRandom(rand) % 100;
+    if (choice < 30 || nrKeys == 0) {
+      r.op = 0;
+      r.key = ++nrKeys;
+    } else if (choice < 95) {
+      double u = static_cast<double>((benchmarkRandom(rand) >> 11) + 1) /
+                 9007199254740992.0;
+      r.op = 1;
+      r.key = 1 + static_cast<uint32_t>(
+                      scrambleRank(zipf.next(nrKeys, u)) % nrKeys);
+    } else {
+      r.op = 1;
+      r.key = nrKeys + 1 + static_cast<uint32_t>(benchmarkRandom(rand) % NrOps);
+    }
+    trace.push_back(r);
+  }
+  return trace;
+}
+
+bool parseList(char const* arg, std::vector<uint64_t>& values) {
+  values.clear();
+  while (*arg != 0) {
+    char* end;
+    unsigned long long value = std::strtoull(arg, &end, 10);
+    if (end == arg || (*end != ',' && *end != 0) || value == 0) {
+      return false;
+    }
+    values.push_back(value);
+    arg = (*end == ',') ? end + 1 : end;
+  }
+  return !values.empty();
+}
+
+bool parsePromotions(char const* arg,
+                     std::vector<CuckooMapPolicy::Promotion>& values) {
+  values.clear();
+  std::string s(arg);
+  size_t start = 0;
+  while (start <= s.size()) {
+    size_t end = s.find(',', start);
+    if (end == std::string::npos) {
+      end = s.size();
+    }
+    std::string name = s.substr(start, end - start);
+    if (name == "always") {
+      values.push_back(CuckooMapPolicy::PromoteAlways);
+    } else if (name == "never") {
+      values.push_back(CuckooMapPolicy::PromoteNever);
+    } else {
+      return false;
+    }
+    start = end + 1;
+  }
+  return !values.empty();
+}
+
+void printResult(Result const& r, bool csv) {
+  Config const& c = r.config;
+  char const* promotion =
+      c.promotion == CuckooMapPolicy::PromoteAlways ? "always" : "never";
+  if (csv) {
+    std::cout << c.firstSize << ',' << c.growth << ',' << c.slots << ','
+              << promotion << ',' << c.shards << ',' << std::fixed
+              << std::setprecision(0) << r.opsPerSecond << ',' << r.p99
+              << ',' << r.memory << ',' << (r.pareto ? 1 : 0) << std::endl;
+  } else {
+    std::cout << std::setw(11) << c.firstSize << std::setw(8) << c.growth
+              << std::setw(7) << c.slots << std::setw(11) << promotion
+              << std::setw(8) << c.shards << std::setw(14) << std::fixed
+              << std::setprecision(0) << r.opsPerSecond << std::setw(10)
+              << r.p99 << std::setw(14) << r.memory
+              << (r.pareto ? "  *" : "") << std::endl;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  std::string tracePath;
+  unsigned nThreads = 1;
+  std::vector<uint64_t> firstSizes = {256, 4096, 65536};
+  std::vector<uint64_t> growths = {2, 4, 8};
+  std::vector<uint64_t> slots = {2, 4, 8};
+  std::vector<CuckooMapPolicy::Promotion> promotions = {
+      CuckooMapPolicy::PromoteAlways, CuckooMapPolicy::PromoteNever};
+  std::vector<uint64_t> shards = {1, 4, 16};
+  bool all = false;
+  bool csv = false;
+  for (int i = 1; i < argc; ++i) {
+    bool ok = true;
+    if (std::strncmp(argv[i], "--trace=", 8) == 0) {
+      tracePath = argv[i] + 8;
+    } else if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+      nThreads = static_cast<unsigned>(atoi(argv[i] + 10));
+      ok = nThreads > 0;
+    } else if (std::strncmp(argv[i], "--first-size=", 13) == 0) {
+      ok = parseList(argv[i] + 13, firstSizes);
+    } else if (std::strncmp(argv[i], "--growth=", 9) == 0) {
+      ok = parseList(argv[i] + 9, growths);
+    } else if (std::strncmp(argv[i], "--slots=", 8) == 0) {
+      ok = parseList(argv[i] + 8, slots);
+    } else if (std::strncmp(argv[i], "--promotion=", 12) == 0) {
+      ok = parsePromotions(argv[i] + 12, promotions);
+    } else if (std::strncmp(argv[i], "--shards=", 9) == 0) {
+      ok = parseList(argv[i] + 9, shards);
+    } else if (std::strcmp(argv[i], "--all") == 0) {
+      all = true;
+    } else if (std::strcmp(argv[i], "--csv") == 0) {
+      csv = true;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      std::cerr << "Invalid argument " << argv[i]
+                << ", see the usage comment in benchmarks/CuckooTuner.cpp"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<TraceRecord> trace;
+  if (tracePath.empty()) {
+    trace = syntheticTrace();
+  } else if (!readTrace(tracePath, trace)) {
+    std::cerr << "Cannot read trace " << tracePath << std::endl;
+    return 1;
+  }
+
+  std::vector<Result> results;
+  for (uint64_t firstSize : firstSizes) {
+    for (uint64_t growth : growths) {
+      for (uint64_t s : slots) {
+        for (CuckooMapPolicy::Promotion promotion : promotions) {
+          for (uint64_t nrShards : shards) {
+            Config c;
+            c.firstSize = firstSize;
+            c.growth = static_cast<uint32_t>(growth);
+            c.slots = static_cast<uint32_t>(s);
+            c.promotion = promotion;
+            c.shards = static_cast<uint32_t>(nrShards);
+            Result r;
+            if (!dispatch(c, trace, nThreads, r)) {
+              std::cerr << "Slots per bucket must be 1, 2, 4, 8 or 16."
+                        << std::endl;
+              return 1;
+            }
+            results.push_back(r);
+          }
+        }
+      }
+    }
+  }
+  markParetoFront(results);
+  std::sort(results.begin(), results.end(),
+            [](Result const& a, Result const& b) {
+              return a.opsPerSecond > b.opsPerSecond;
+            });
+
+  if (csv) {
+    std::cout << "first_size,growth,slots,promotion,shards,ops_per_sec,"
+                 "p99_ns,memory_bytes,pareto"
+              << std::endl;
+  } else {
+    std::cout << "Replayed " << trace.size() << " operations in each of "
+              << nThreads << " thread(s), " << results.size()
+              << " configurations"
+              << (all ? ", * marks the Pareto front:" : ", Pareto front:")
+              << std::endl;
+    std::cout << std::setw(11) << "first size" << std::setw(8) << "growth"
+              << std::setw(7) << "slots" << std::setw(11) << "promotion"
+              << std::setw(8) << "shards" << std::setw(14) << "ops/s"
+              << std::setw(10) << "p99[ns]" << std::setw(14) << "memory[B]"
+              << std::endl;
+  }
+  for (Result const& r : results) {
+    if (all || r.pareto) {
+      printResult(r, csv);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,199 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cuckoomap/CuckooHashes.h>
+#include <cuckoomap/CuckooHelpers.h>
+
+#include "MicroBenchmark.h"
+
+// Speed and quality of the hash functions of CuckooHelpers.h and
+// CuckooHashes.h. The speed is measured with the usual benchmark options,
+// with --quality the quality is reported instead:
+//
+//   - avalanche: the largest deviation over all input and output bits
+//     of 8-byte keys of the probability that flipping the input bit flips
+//     the output bit from 1/2, scaled to [0, 1] (0 is ideal, sampling
+//     noise alone gives about 0.06)
+//   - buckets: the chi-square statistic per degree of freedom of the
+//     keys 1, 2, ..., 2^20 spread over 2^16 buckets by the middle bits of
+//     the hash, as the cuckoo maps pick buckets (about 1 is ideal, much
+//     more means clustering)
+//
+// The batch/ benchmarks hash 64 keys of a fixed width at a time with the
+// kernels of hashBatch, the time per key is reported.
+//
+// Usage: HashBenchmark [--quality] [benchmark options]
+
+typedef uint64_t (*HashFunction)(void const*, size_t, uint64_t);
+
+struct NamedHash {
+  std::string name;
+  HashFunction function;
+  size_t maxLength;  // longest key it can hash
+};
+
+static uint64_t multiplyShift64(void const* buf, size_t len, uint64_t seed) {
+  // A new functor per call would recompute the multiplier, so the seed is
+  // fixed here:
+  static MultiplyShiftHash<uint64_t, 0xdeadbeefdeadbeefULL> const hash;
+  (void)seed;
+  uint64_t x = 0;
+  std::memcpy(&x, buf, len);
+  return hash(x);
+}
+
+static std::vector<NamedHash> hashes() {
+  std::vector<NamedHash> res;
+  res.push_back(NamedHash{"fasthash64", &fasthash64, SIZE_MAX});
+  res.push_back(NamedHash{"wyhash", &wyHash64, SIZE_MAX});
+  if (cuckooCpuHasCrc32c()) {
+    res.push_back(NamedHash{"crc32c", &crc32cHash64, SIZE_MAX});
+  }
+  if (cuckooCpuHasAes()) {
+    res.push_back(NamedHash{"aes", &aesHash64, SIZE_MAX});
+  }
+  res.push_back(NamedHash{"multiplyShift", &multiplyShift64, 8});
+  return res;
+}
+
+static void registerHash(NamedHash const& hash, size_t len) {
+  HashFunction function = hash.function;
+  registerBenchmark(hash.name + "/" + std::to_string(len),
+                    [function, len](BenchmarkState& state) {
+                      uint64_t rand = 0x1234;
+                      std::vector<uint64_t> buffer((len + 7) / 8 + 1);
+                      for (auto& word : buffer) {
+                        word = benchmarkRandom(rand);
+                      }
+                      uint64_t h = 0;
+                      state.setItemsPerIteration(static_cast<double>(len));
+                      while (state.keepRunning()) {
+                        // Chain the results to measure latency rather than
+                        // throughput, as a hash table probe would:
+                        buffer[0] ^= h;
+                        h = function(buffer.data(), len, 0x5eed);
+                      }
+                      doNotOptimize(h);
+                    });
+}
+
+template <size_t Bytes>
+struct Blob {
+  unsigned char bytes[Bytes];
+};
+
+template <size_t Bytes>
+static void registerBatch(std::string const& name,
+                          void (*kernel)(Blob<Bytes> const*, size_t,
+                                         uint64_t*, uint64_t*)) {
+  registerBenchmark(
+      "batch/" + name + "/" + std::to_string(Bytes),
+      [kernel](BenchmarkState& state) {
+        static constexpr size_t Batch = 64;
+        std::vector<Blob<Bytes>> keys(Batch);
+        uint64_t rand = 0x1234;
+        for (auto& key : keys) {
+          for (size_t i = 0; i < Bytes; ++i) {
+            key.bytes[i] = static_cast<unsigned char>(benchmarkRandom(rand));
+          }
+        }
+        uint64_t out1[Batch];
+        uint64_t out2[Batch];
+        state.setItemsPerIteration(Batch);
+        while (state.keepRunning()) {
+          kernel(keys.data(), Batch, out1, out2);
+          keys[0].bytes[0] ^= static_cast<unsigned char>(out1[Batch - 1]);
+        }
+        doNotOptimize(out2[0]);
+      });
+}
+
+template <size_t Bytes>
+static void registerBatches() {
+  registerBatch<Bytes>("scalar", &hashBatchScalar<0x5eed, Blob<Bytes>>);
+#if CUCKOO_HASH_X86
+  if (cuckooCpuHasAvx2()) {
+    registerBatch<Bytes>("avx2", &hashBatchAvx2<0x5eed, Blob<Bytes>>);
+  }
+  if (cuckooCpuHasAvx512()) {
+    registerBatch<Bytes>("avx512", &hashBatchAvx512<0x5eed, Blob<Bytes>>);
+  }
+#endif
+}
+
+static double avalancheBias(HashFunction function) {
+  static constexpr int Samples = 4000;
+  std::vector<uint32_t> flips(64 * 64, 0);
+  uint64_t rand = 42;
+  for (int s = 0; s < Samples; ++s) {
+    uint64_t key = benchmarkRandom(rand);
+    uint64_t h = function(&key, sizeof(key), 0x5eed);
+    for (int in = 0; in < 64; ++in) {
+      uint64_t flipped = key ^ (1ULL << in);
+      uint64_t diff = h ^ function(&flipped, sizeof(flipped), 0x5eed);
+      for (int out = 0; out < 64; ++out) {
+        flips[in * 64 + out] += (diff >> out) & 1;
+      }
+    }
+  }
+  double worst = 0.0;
+  for (uint32_t count : flips) {
+    double bias = std::fabs(2.0 * count / Samples - 1.0);
+    worst = bias > worst ? bias : worst;
+  }
+  return worst;
+}
+
+static double bucketChiSquare(HashFunction function) {
+  static constexpr uint32_t LogBuckets = 16;
+  static constexpr uint64_t Keys = 1ULL << 20;
+  static constexpr uint32_t Shift = (64 - LogBuckets) / 2;
+  std::vector<uint32_t> counts(1 << LogBuckets, 0);
+  for (uint64_t key = 1; key <= Keys; ++key) {
+    uint64_t h = function(&key, sizeof(key), 0x5eed);
+    ++counts[(h >> Shift) & ((1 << LogBuckets) - 1)];
+  }
+  double expected = static_cast<double>(Keys) / counts.size();
+  double chi = 0.0;
+  for (uint32_t count : counts) {
+    chi += (count - expected) * (count - expected) / expected;
+  }
+  return chi / (counts.size() - 1);
+}
+
+static int reportQuality() {
+  std::cout << std::left << std::setw(20) << "hash" << std::right
+            << std::setw(12) << "avalanche" << std::setw(12) << "buckets"
+            << std::endl;
+  for (NamedHash const& hash : hashes()) {
+    std::cout << std::left << std::setw(20) << hash.name << std::right
+              << std::fixed << std::setprecision(3) << std::setw(12)
+              << avalancheBias(hash.function) << std::setw(12)
+              << bucketChiSquare(hash.function) << std::endl;
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && std::strcmp(argv[1], "--quality") == 0) {
+    return reportQuality();
+  }
+  size_t lengths[] = {4, 8, 16, 32, 64, 256};
+  for (NamedHash const& hash : hashes()) {
+    for (size_t len : lengths) {
+      if (len <= hash.maxLength) {
+        registerHash(hash, len);
+      }
+    }
+  }
+  registerBatches<4>();
+  registerBatches<8>();
+  registerBatches<16>();
+  registerBatches<64>();
+  return runBenchmarks(argc, argv);
+}
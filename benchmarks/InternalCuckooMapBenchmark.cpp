@@ -0,0 +1,141 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <cuckoomap/InternalCuckooMap.h>
+
+#include "MicroBenchmark.h"
+
+struct Key {
+  uint64_t k;
+  Key() : k(0) {}
+  Key(uint64_t i) : k(i) {}
+  bool empty() { return k == 0; }
+};
+
+namespace std {
+
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+struct Value {
+  uint64_t v;
+};
+
+typedef InternalCuckooMap<Key, Value> Map;
+typedef InternalCuckooMap<Key, Value, HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+                          SingleHash>
+    SingleHashMap;
+
+static constexpr uint64_t Capacity = 1 << 20;
+static constexpr int MaxKicks = 500;
+
+// Inserts k with at most MaxKicks evictions, returns false if in the end
+// some pair had to be dropped:
+template <class Map>
+static bool insertWithKicks(Map& map, Key k) {
+  Value v;
+  v.v = k.k;
+  int res = 1;
+  for (int count = 0; res == 1 && count < MaxKicks; ++count) {
+    res = map.insert(k, &v, nullptr, nullptr);
+  }
+  return res == 0;
+}
+
+// Fills the map with random odd keys up to the given load factor and
+// returns the keys which are actually in the table:
+template <class Map>
+static std::vector<Key> fill(Map& map, double load, uint64_t& rand) {
+  std::vector<Key> keys;
+  while (map.nrUsed() < load * map.capacity() &&
+         keys.size() < 2 * map.capacity()) {
+    Key k(benchmarkRandom(rand) | 1);
+    insertWithKicks(map, k);
+    keys.push_back(k);
+  }
+  std::vector<Key> present;
+  for (Key const& k : keys) {
+    Key* kOut;
+    Value* vOut;
+    if (map.lookup(k, kOut, vOut)) {
+      present.push_back(k);
+    }
+  }
+  return present;
+}
+
+static std::string loadName(double load) {
+  return std::to_string(static_cast<int>(load * 100 + 0.5));
+}
+
+// prefix names the kind of Map:
+template <class Map>
+static void registerMap(std::string const& prefix, double load) {
+  registerBenchmark(prefix + "/lookupHit/load:" + loadName(load),
+                    [load](BenchmarkState& state) {
+                      Map map(Capacity);
+                      uint64_t rand = 1;
+                      std::vector<Key> keys = fill(map, load, rand);
+                      Key* kOut;
+                      Value* vOut;
+                      while (state.keepRunning()) {
+                        Key const& k = keys[state.iterations() % keys.size()];
+                        doNotOptimize(map.lookup(k, kOut, vOut));
+                      }
+                    });
+
+  registerBenchmark(prefix + "/lookupMiss/load:" + loadName(load),
+                    [load](BenchmarkState& state) {
+                      Map map(Capacity);
+                      uint64_t rand = 1;
+                      fill(map, load, rand);
+                      Key* kOut;
+                      Value* vOut;
+                      while (state.keepRunning()) {
+                        // Even keys have never been inserted:
+                        Key k(benchmarkRandom(rand) & ~1ULL);
+                        doNotOptimize(map.lookup(k, kOut, vOut));
+                      }
+                    });
+
+  // Inserts batches of fresh keys (including their eviction chains) and
+  // removes them again untimed, such that the load factor stays within
+  // 0.5% of the nominal one:
+  registerBenchmark(
+      prefix + "/insert/load:" + loadName(load),
+      [load](BenchmarkState& state) {
+        Map map(Capacity);
+        uint64_t rand = 1;
+        fill(map, load, rand);
+        std::vector<Key> batch(Capacity / 200);
+        for (auto& k : batch) {
+          k = Key(benchmarkRandom(rand) | 1);
+        }
+        size_t next = 0;
+        while (state.keepRunning()) {
+          if (next == batch.size()) {
+            state.pauseTiming();
+            for (auto& k : batch) {
+              map.remove(k);
+              k = Key(benchmarkRandom(rand) | 1);
+            }
+            next = 0;
+            state.resumeTiming();
+          }
+          insertWithKicks(map, batch[next++]);
+        }
+      });
+}
+
+int main(int argc, char* argv[]) {
+  double loads[] = {0.25, 0.5, 0.75, 0.85};
+  for (double load : loads) {
+    registerMap<Map>("InternalCuckooMap", load);
+    registerMap<SingleHashMap>("InternalCuckooMap/singleHash", load);
+  }
+  return runBenchmarks(argc, argv);
+}
@@ -0,0 +1,166 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include <cuckoomap/CuckooMap.h>
+#include <cuckoomap/ShardedMap.h>
+
+#include "MicroBenchmark.h"
+
+// Inserts up to N random keys into a ShardedMap<CuckooMap> and into a
+// std::unordered_map and samples at roughly every quarter power of two
+// the bytes per entry, the number of layers and the load factor of every
+// layer (summed over the shards). The memory of std::unordered_map is
+// counted by its allocator, the allocator's own overhead is not included
+// for either map.
+//
+// Usage: MemoryBenchmark [--keys=N] [--first-size=N] [--shards=N] [--csv]
+
+struct Key {
+  uint64_t k;
+  Key() : k(0) {}
+  Key(uint64_t i) : k(i) {}
+  bool empty() { return k == 0; }
+};
+
+namespace std {
+
+template <>
+struct equal_to<Key> {
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+};
+}
+
+struct Value {
+  uint64_t v;
+};
+
+typedef HashWithSeed<Key, 0xdeadbeefdeadbeefULL> KeyHash;
+
+static uint64_t allocatedBytes = 0;
+
+template <class T>
+struct CountingAllocator {
+  typedef T value_type;
+
+  CountingAllocator() {}
+  template <class U>
+  CountingAllocator(CountingAllocator<U> const&) {}
+
+  T* allocate(size_t n) {
+    allocatedBytes += n * sizeof(T);
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+    allocatedBytes -= n * sizeof(T);
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <class U>
+  bool operator==(CountingAllocator<U> const&) const {
+    return true;
+  }
+  template <class U>
+  bool operator!=(CountingAllocator<U> const&) const {
+    return false;
+  }
+};
+
+typedef ShardedMap<CuckooMap<Key, Value>> Map;
+typedef std::unordered_map<Key, Value, KeyHash, std::equal_to<Key>,
+                           CountingAllocator<std::pair<Key const, Value>>>
+    Reference;
+
+static void printSample(uint64_t n, Map const& map, Reference const& ref,
+                        bool csv) {
+  CuckooMapStats s = map.stats().total;
+  double cuckooBytes = static_cast<double>(map.memoryUsage()) / n;
+  double refBytes =
+      static_cast<double>(sizeof(Reference) + allocatedBytes) / n;
+  std::ostringstream loads;
+  loads << std::fixed << std::setprecision(3);
+  for (size_t i = 0; i < s.layers.size(); ++i) {
+    loads << (i == 0 ? "" : csv ? ";" : " ")
+          << static_cast<double>(s.layers[i].nrUsed) / s.layers[i].capacity;
+  }
+  if (csv) {
+    std::cout << n << ',' << std::fixed << std::setprecision(2) << cuckooBytes
+              << ',' << s.layers.size() << ',' << loads.str() << ','
+              << refBytes << ',' << std::setprecision(3) << ref.load_factor()
+              << std::endl;
+  } else {
+    std::cout << std::setw(12) << n << std::setw(14) << std::fixed
+              << std::setprecision(2) << cuckooBytes << std::setw(8)
+              << s.layers.size() << std::setw(14) << refBytes << std::setw(10)
+              << std::setprecision(3) << ref.load_factor() << "  "
+              << loads.str() << std::endl;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t nrKeys = 1000000;
+  uint64_t firstSize = 1024;
+  uint32_t nrShards = 1;
+  bool csv = false;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strncmp(argv[i], "--keys=", 7) == 0) {
+      nrKeys = std::strtoull(argv[i] + 7, nullptr, 10);
+    } else if (std::strncmp(argv[i], "--first-size=", 13) == 0) {
+      firstSize = std::strtoull(argv[i] + 13, nullptr, 10);
+    } else if (std::strncmp(argv[i], "--shards=", 9) == 0) {
+      nrShards = static_cast<uint32_t>(atoi(argv[i] + 9));
+    } else if (std::strcmp(argv[i], "--csv") == 0) {
+      csv = true;
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--keys=N] [--first-size=N] [--shards=N] [--csv]"
+                << std::endl;
+      return 1;
+    }
+  }
+  if (nrKeys == 0 || firstSize == 0 || nrShards == 0) {
+    std::cerr << "Keys, first size and shards must be positive." << std::endl;
+    return 1;
+  }
+
+  if (csv) {
+    std::cout << "keys,cuckoo_bytes_per_entry,cuckoo_layers,"
+                 "cuckoo_layer_load_factors,unordered_bytes_per_entry,"
+                 "unordered_load_factor"
+              << std::endl;
+  } else {
+    std::cout << std::setw(12) << "keys" << std::setw(14) << "cuckoo B/key"
+              << std::setw(8) << "layers" << std::setw(14) << "unord. B/key"
+              << std::setw(10) << "unord. lf" << "  layer load factors"
+              << std::endl;
+  }
+
+  Map map(firstSize, nrShards);
+  Reference ref;
+  Value v;
+  uint64_t rand = 1;
+  uint64_t nextSample = 16;
+  for (uint64_t n = 1; n <= nrKeys; ++n) {
+    Key k(benchmarkRandom(rand) | 1);  // never the empty key 0
+    v.v = n;
+    if (!map.insert(k, &v)) {
+      --n;  // duplicate random key, draw another
+      continue;
+    }
+    ref.emplace(k, v);
+    if (n == nextSample || n == nrKeys) {
+      printSample(n, map, ref, csv);
+      while (nextSample <= n) {
+        nextSample += (nextSample >> 2) > 0 ? (nextSample >> 2) : 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,243 @@
+#ifndef MICRO_BENCHMARK_H
+#define MICRO_BENCHMARK_H 1
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "PerfCounters.h"
+
+// A minimal in-tree microbenchmark harness modelled after Google Benchmark,
+// so that the benchmarks build without external dependencies. Every
+// benchmark is a function which does its (untimed) setup once and then
+// loops while state.keepRunning() returns true:
+//
+//   void lookupHit(BenchmarkState& state) {
+//     ... setup ...
+//     while (state.keepRunning()) {
+//       doNotOptimize(map.lookup(...));
+//     }
+//   }
+//
+// The clock starts with the first call of keepRunning(), pauseTiming() and
+// resumeTiming() exclude work within the loop. keepRunning() only looks at
+// the clock every few hundred iterations and stops once the benchmark has
+// run for the minimal time, which avoids repeating expensive setups for
+// calibration. The reported time is the timed (not paused) wall time per
+// iteration. With --perf, hardware counters (see PerfCounters.h) run
+// exactly while the clock runs and are reported per iteration as well.
+
+template <class T>
+inline void doNotOptimize(T const& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// splitmix64, good enough to generate keys for benchmarks:
+inline uint64_t benchmarkRandom(uint64_t& state) {
+  uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+class BenchmarkState {
+  static constexpr uint64_t CheckInterval = 256;
+  typedef std::chrono::steady_clock Clock;
+
+ public:
+  BenchmarkState(double minSeconds, PerfCounters* counters)
+      : _minNanos(static_cast<uint64_t>(minSeconds * 1e9)),
+        _iterations(0),
+        _nextCheck(CheckInterval),
+        _timedNanos(0),
+        _running(false),
+        _itemsPerIteration(1.0),
+        _counters(counters) {}
+
+  bool keepRunning() {
+    if (_iterations == 0) {
+      resumeTiming();
+    }
+    if (++_iterations < _nextCheck) {
+      return true;
+    }
+    _nextCheck += CheckInterval;
+    if (elapsedNanos() < _minNanos) {
+      return true;
+    }
+    pauseTiming();
+    --_iterations;  // the last call did not start an iteration
+    return false;
+  }
+
+  void pauseTiming() {
+    if (_running) {
+      if (_counters != nullptr) {
+        _counters->stop();
+      }
+      _timedNanos += sinceStart();
+      _running = false;
+    }
+  }
+
+  void resumeTiming() {
+    if (!_running) {
+      _running = true;
+      _start = Clock::now();
+      if (_counters != nullptr) {
+        _counters->start();
+      }
+    }
+  }
+
+  // Number of iterations done so far, starting with 0 in the first one:
+  uint64_t iterations() const { return _iterations - 1; }
+
+  // Use this if one iteration handles more than one item, the report
+  // then also shows the time per item:
+  void setItemsPerIteration(double items) { _itemsPerIteration = items; }
+
+  uint64_t totalIterations() const { return _iterations; }
+
+  double nanosPerIteration() const {
+    return _iterations == 0 ? 0.0
+                            : static_cast<double>(_timedNanos) / _iterations;
+  }
+
+  double itemsPerIteration() const { return _itemsPerIteration; }
+
+ private:
+  uint64_t sinceStart() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               Clock::now() - _start)
+        .count();
+  }
+
+  uint64_t elapsedNanos() const {
+    return _timedNanos + (_running ? sinceStart() : 0);
+  }
+
+  uint64_t _minNanos;
+  uint64_t _iterations;
+  uint64_t _nextCheck;
+  uint64_t _timedNanos;
+  bool _running;
+  double _itemsPerIteration;
+  PerfCounters* _counters;
+  Clock::time_point _start;
+};
+
+struct Benchmark {
+  std::string name;
+  std::function<void(BenchmarkState&)> function;
+};
+
+inline std::vector<Benchmark>& benchmarkRegistry() {
+  static std::vector<Benchmark> registry;
+  return registry;
+}
+
+inline void registerBenchmark(std::string const& name,
+                              std::function<void(BenchmarkState&)> function) {
+  Benchmark b;
+  b.name = name;
+  b.function = function;
+  benchmarkRegistry().push_back(b);
+}
+
+// Runs all registered benchmarks whose name contains the filter string.
+// Options:
+//   --filter=STRING: only run benchmarks whose name contains STRING
+//   --min-time=SECONDS: minimal timed duration per benchmark (default 0.2)
+//   --csv: print CSV instead of a table
+//   --perf: also report hardware counters per iteration
+inline int runBenchmarks(int argc, char* argv[]) {
+  std::string filter;
+  double minSeconds = 0.2;
+  bool csv = false;
+  bool perf = false;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+      filter = argv[i] + 9;
+    } else if (std::strncmp(argv[i], "--min-time=", 11) == 0) {
+      minSeconds = atof(argv[i] + 11);
+    } else if (std::strcmp(argv[i], "--csv") == 0) {
+      csv = true;
+    } else if (std::strcmp(argv[i], "--perf") == 0) {
+      perf = true;
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--filter=STRING] [--min-time=SECONDS] [--csv] [--perf]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  PerfCounters counters;
+  if (perf && !counters.available()) {
+    std::cerr << "Hardware counters unavailable (" << counters.error()
+              << "), reporting times only." << std::endl;
+    perf = false;
+  }
+
+  if (csv) {
+    std::cout << "name,iterations,ns_per_iteration,ns_per_item";
+    for (int e = 0; perf && e < PerfCounters::NrEvents; ++e) {
+      std::cout << ',' << PerfCounters::name(e) << "_per_iteration";
+    }
+  } else {
+    std::cout << std::left << std::setw(48) << "benchmark" << std::right
+              << std::setw(14) << "iterations" << std::setw(14) << "ns/iter"
+              << std::setw(14) << "ns/item";
+    for (int e = 0; perf && e < PerfCounters::NrEvents; ++e) {
+      std::cout << std::setw(15) << PerfCounters::name(e);
+    }
+  }
+  std::cout << std::endl;
+  for (Benchmark const& b : benchmarkRegistry()) {
+    if (b.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    uint64_t before[PerfCounters::NrEvents] = {0};
+    uint64_t after[PerfCounters::NrEvents] = {0};
+    counters.read(before);
+    BenchmarkState state(minSeconds, perf ? &counters : nullptr);
+    b.function(state);
+    counters.read(after);
+    double perIteration = state.nanosPerIteration();
+    double perItem = perIteration / state.itemsPerIteration();
+    if (csv) {
+      std::cout << b.name << ',' << state.totalIterations() << ','
+                << std::fixed << std::setprecision(3) << perIteration << ','
+                << perItem;
+    } else {
+      std::cout << std::left << std::setw(48) << b.name << std::right
+                << std::setw(14) << state.totalIterations() << std::setw(14)
+                << std::fixed << std::setprecision(2) << perIteration
+                << std::setw(14) << perItem;
+    }
+    for (int e = 0; perf && e < PerfCounters::NrEvents; ++e) {
+      if (!csv) {
+        std::cout << std::setw(15);
+      } else {
+        std::cout << ',';
+      }
+      if (counters.available(static_cast<PerfCounters::Event>(e))) {
+        std::cout << static_cast<double>(after[e] - before[e]) /
+                         state.totalIterations();
+      } else {
+        std::cout << (csv ? "" : "n/a");
+      }
+    }
+    std::cout << std::endl;
+  }
+  return 0;
+}
+
+#endif
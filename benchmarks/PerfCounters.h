@@ -0,0 +1,182 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H 1
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters of the calling thread via Linux
+// perf_event_open(2). The counters are opened as one group, so they are
+// scheduled onto the PMU together and their ratios are meaningful; if the
+// kernel has to multiplex, the values are scaled by enabled/running time.
+// Events which the machine or the kernel settings (see
+// /proc/sys/kernel/perf_event_paranoid) do not allow are reported as
+// unavailable, on other systems all of them are. Only user space is
+// counted.
+//
+// Usage: construct in the thread to be measured, bracket every measured
+// phase with start() and stop() (the counts accumulate), then read().
+
+class PerfCounters {
+ public:
+  enum Event {
+    Cycles = 0,
+    Instructions,
+    LlcMisses,
+    DtlbMisses,
+    BranchMisses,
+    NrEvents
+  };
+
+  static char const* name(int event) {
+    static char const* names[NrEvents] = {"cycles", "instructions",
+                                          "llc_misses", "dtlb_misses",
+                                          "branch_misses"};
+    return names[event];
+  }
+
+  PerfCounters() : _leader(-1), _nrOpen(0) {
+    for (int e = 0; e < NrEvents; ++e) {
+      _fds[e] = -1;
+      _slot[e] = -1;
+    }
+#ifdef __linux__
+    for (int e = 0; e < NrEvents; ++e) {
+      struct perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      configure(static_cast<Event>(e), attr);
+      attr.disabled = (_leader == -1) ? 1 : 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+      int fd = static_cast<int>(
+          syscall(SYS_perf_event_open, &attr, 0, -1, _leader, 0));
+      if (fd < 0) {
+        if (_leader == -1) {
+          _error = std::string("perf_event_open: ") + std::strerror(errno);
+          return;  // without cycles we do not measure anything
+        }
+        continue;
+      }
+      if (_leader == -1) {
+        _leader = fd;
+      }
+      _fds[e] = fd;
+      _slot[e] = _nrOpen++;
+    }
+#else
+    _error = "hardware counters are only supported on Linux";
+#endif
+  }
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (int e = 0; e < NrEvents; ++e) {
+      if (_fds[e] >= 0) {
+        close(_fds[e]);
+      }
+    }
+#endif
+  }
+
+  PerfCounters(PerfCounters const&) = delete;
+  PerfCounters& operator=(PerfCounters const&) = delete;
+
+  bool available() const { return _leader >= 0; }
+
+  bool available(Event e) const { return _slot[e] >= 0; }
+
+  // Reason why no counters are available:
+  std::string const& error() const { return _error; }
+
+  void start() {
+#ifdef __linux__
+    if (_leader >= 0) {
+      ioctl(_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+
+  void stop() {
+#ifdef __linux__
+    if (_leader >= 0) {
+      ioctl(_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+
+  // Adds the accumulated counts to values, unavailable events add 0:
+  void read(uint64_t values[NrEvents]) const {
+#ifdef __linux__
+    if (_leader < 0) {
+      return;
+    }
+    uint64_t buffer[3 + NrEvents];
+    ssize_t n = ::read(_leader, buffer, sizeof(buffer));
+    if (n < static_cast<ssize_t>(3 * sizeof(uint64_t))) {
+      return;
+    }
+    double scale = 1.0;
+    if (buffer[2] > 0 && buffer[2] < buffer[1]) {
+      scale = static_cast<double>(buffer[1]) / buffer[2];
+    }
+    for (int e = 0; e < NrEvents; ++e) {
+      if (_slot[e] >= 0 && static_cast<uint64_t>(_slot[e]) < buffer[0]) {
+        values[e] += static_cast<uint64_t>(buffer[3 + _slot[e]] * scale);
+      }
+    }
+#else
+    (void)values;
+#endif
+  }
+
+ private:
+#ifdef __linux__
+  static void configure(Event e, struct perf_event_attr& attr) {
+    switch (e) {
+      case Cycles:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case Instructions:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case LlcMisses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_LL |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+      case DtlbMisses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+      default:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+  }
+#endif
+
+  int _leader;            // group leader (cycles), -1 if not available
+  int _fds[NrEvents];     // file descriptor per event, -1 if not open
+  int _slot[NrEvents];    // position of the event in a group read
+  int _nrOpen;
+  std::string _error;
+};
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef CUCKOO_COROUTINES_H
+#define CUCKOO_COROUTINES_H 1
+
+// Interleaved lookups with C++20 coroutines: CuckooMap::co_lookup (also
+// on ShardedMap) is a lock-free lookup like lookupCopy, which prefetches
+// the buckets of its key in a layer and suspends before it touches them.
+// Resuming many such lookups in turn lets the cache misses of all of them
+// overlap, without batching the callers:
+//
+//   interleavedLookups(map, keys, n, values, found, 8);
+//
+// runs the lookups of keys[0..n) with up to 8 of them in flight and
+// stores whether and what it found in found[i] and values[i]. Custom
+// schedulers can drive the CuckooLookupTask objects themselves, a task
+// must be resumed by the thread which created it, since it stays in an
+// EpochGuard while suspended.
+//
+// Everything in here needs C++20 and is only compiled if the compiler
+// supports coroutines (CUCKOO_MAP_COROUTINES is then 1). Compile with
+// -DCUCKOO_MAP_COROUTINES=0 to leave it out regardless.
+
+#ifndef CUCKOO_MAP_COROUTINES
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define CUCKOO_MAP_COROUTINES 1
+#endif
+#endif
+#endif
+
+#ifndef CUCKOO_MAP_COROUTINES
+#define CUCKOO_MAP_COROUTINES 0
+#endif
+
+#if CUCKOO_MAP_COROUTINES
+
+#include <coroutine>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+// The running lookup of CuckooMap::co_lookup. It starts right away and
+// suspends after its first prefetch. Destroying it before done() is
+// allowed and abandons the lookup.
+class CuckooLookupTask {
+ public:
+  struct promise_type {
+    bool found = false;
+
+    CuckooLookupTask get_return_object() {
+      return CuckooLookupTask(Handle::from_promise(*this));
+    }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_value(bool f) { found = f; }
+    void unhandled_exception() { throw; }
+
+    // Frames are recycled per thread, so that an interleaved lookup does
+    // not cost an allocation:
+    static void* operator new(size_t size) {
+      FramePool& pool = framePool();
+      if (pool.head != nullptr && pool.head->size >= size) {
+        Frame* frame = pool.head;
+        pool.head = frame->next;
+        --pool.count;
+        return frame + 1;
+      }
+      Frame* frame = static_cast<Frame*>(::operator new(sizeof(Frame) + size));
+      frame->size = size;
+      return frame + 1;
+    }
+
+    static void operator delete(void* p) {
+      Frame* frame = static_cast<Frame*>(p) - 1;
+      FramePool& pool = framePool();
+      if (pool.count < FramePool::MaxFrames) {
+        frame->next = pool.head;
+        pool.head = frame;
+        ++pool.count;
+      } else {
+        ::operator delete(frame);
+      }
+    }
+  };
+
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  CuckooLookupTask() : _handle(nullptr) {}
+  explicit CuckooLookupTask(Handle h) : _handle(h) {}
+
+  CuckooLookupTask(CuckooLookupTask&& other) : _handle(other._handle) {
+    other._handle = nullptr;
+  }
+
+  CuckooLookupTask& operator=(CuckooLookupTask&& other) {
+    if (this != &other) {
+      if (_handle) {
+        _handle.destroy();
+      }
+      _handle = other._handle;
+      other._handle = nullptr;
+    }
+    return *this;
+  }
+
+  CuckooLookupTask(CuckooLookupTask const&) = delete;
+  CuckooLookupTask& operator=(CuckooLookupTask const&) = delete;
+
+  ~CuckooLookupTask() {
+    if (_handle) {
+      _handle.destroy();
+    }
+  }
+
+  explicit operator bool() const { return static_cast<bool>(_handle); }
+
+  bool done() const { return _handle.done(); }
+
+  // Runs the lookup up to its next prefetch or to its end:
+  void resume() { _handle.resume(); }
+
+  // Only valid once done():
+  bool found() const { return _handle.promise().found; }
+
+ private:
+  // Header of a coroutine frame, aligned so that the frame behind it is
+  // aligned for anything:
+  struct alignas(alignof(std::max_align_t)) Frame {
+    size_t size;
+    Frame* next;  // in the pool
+  };
+
+  struct FramePool {
+    static constexpr size_t MaxFrames = 256;
+    Frame* head = nullptr;
+    size_t count = 0;
+
+    ~FramePool() {
+      while (head != nullptr) {
+        Frame* next = head->next;
+        ::operator delete(head);
+        head = next;
+      }
+    }
+  };
+
+  static FramePool& framePool() {
+    static thread_local FramePool pool;
+    return pool;
+  }
+
+  Handle _handle;
+};
+
+// Looks up keys[0..n) in map with up to width lookups in flight, see the
+// top of this file. Map is a CuckooMap or ShardedMap. Returns the number
+// of keys found.
+template <class Map, class Key, class Value>
+size_t interleavedLookups(Map& map, Key const* keys, size_t n, Value* values,
+                          bool* found, size_t width = 8) {
+  static constexpr size_t MaxWidth = 64;
+  if (width == 0) {
+    width = 1;
+  } else if (width > MaxWidth) {
+    width = MaxWidth;
+  }
+  CuckooLookupTask tasks[MaxWidth];
+  size_t which[MaxWidth];
+  size_t next = 0;
+  size_t active = 0;
+  size_t hits = 0;
+  for (size_t i = 0; i < width && next < n; ++i, ++next, ++active) {
+    tasks[i] = map.co_lookup(keys[next], &values[next]);
+    which[i] = next;
+  }
+  while (active > 0) {
+    for (size_t i = 0; i < width; ++i) {
+      if (!tasks[i]) {
+        continue;
+      }
+      if (!tasks[i].done()) {
+        tasks[i].resume();
+      }
+      if (tasks[i].done()) {
+        found[which[i]] = tasks[i].found();
+        hits += tasks[i].found() ? 1 : 0;
+        if (next < n) {
+          tasks[i] = map.co_lookup(keys[next], &values[next]);
+          which[i] = next++;
+        } else {
+          tasks[i] = CuckooLookupTask();
+          --active;
+        }
+      }
+    }
+  }
+  return hits;
+}
+
+#endif
+
+#endif
@@ -36,7 +36,8 @@ class CuckooFilter {
   static constexpr uint32_t SlotsPerBucket = 4;
 
  public:
-  CuckooFilter(uint64_t size) : _randState(0x2636283625154737ULL) {
+  CuckooFilter(uint64_t size)
+      : _randState(0x2636283625154737ULL), _nrUsed(0) {
     // Sort out offsets and alignments:
     _slotSize = sizeof(uint16_t);
 
@@ -101,6 +102,18 @@ class CuckooFilter {
     return false;
   }
 
+  // Hints the CPU to load the buckets of k into the cache, changes
+  // nothing:
+  void prefetch(Key const& k) {
+    uint64_t hash1 = _hasherKey(k);
+    uint64_t pos1 = hashToPos(hash1);
+    uint64_t pos2 =
+        hashToPos(_hasherPosFingerprint(pos1, hashToFingerprint(hash1)));
+    // A bucket is 8 bytes and 8-byte aligned, so one cache line:
+    __builtin_prefetch(findSlot(pos1, 0), 0, 3);
+    __builtin_prefetch(findSlot(pos2, 0), 0, 3);
+  }
+
   void insert(Key& k) {
     // insert the key k
     //
@@ -182,6 +195,7 @@ class CuckooFilter {
       uint16_t* fTable = findSlot(pos1, i);
       if (fingerprint == *fTable) {
         *fTable = 0;
+        --_nrUsed;
         return true;
       }
     }
@@ -189,6 +203,7 @@ class CuckooFilter {
       uint16_t* fTable = findSlot(pos2, i);
       if (fingerprint == *fTable) {
         *fTable = 0;
+        --_nrUsed;
         return true;
       }
     }
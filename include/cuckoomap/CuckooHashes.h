@@ -0,0 +1,520 @@
+#ifndef CUCKOO_HASHES_H
+#define CUCKOO_HASHES_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "CuckooHelpers.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CUCKOO_HASH_X86 1
+#else
+#define CUCKOO_HASH_X86 0
+#endif
+
+// Hash policies for HashKey1 and HashKey2 (and CuckooFilter's HashKey),
+// all hashing the bytes of a T with a seed like HashWithSeed:
+//
+//   Crc32cHash<T, Seed>         two interleaved CRC32C streams (SSE4.2)
+//   AesHash<T, Seed>            one AES round per 16 bytes (AES-NI)
+//   WyHash<T, Seed>             wyhash-style 64x64->128 multiply-mix
+//   MultiplyShiftHash<T, Seed>  multiply-shift for T of at most 8 bytes
+//   DispatchHash<T, Seed>       the first of AesHash, Crc32cHash and WyHash
+//                               the CPU supports
+//   BatchHash<T, Seed>          multiply-xorshift over 8-byte words, which
+//                               hashBatch computes for many keys at once
+//
+// The instruction set of Crc32cHash and AesHash is checked at runtime
+// when the functor is constructed, they fall back to WyHash without it.
+// Unless the whole program is compiled for it (for example -msse4.2 or
+// -maes), the hardware paths are then called rather than inlined. The
+// same goes for the AVX2 and AVX-512 kernels of hashBatch. All of
+// these hash differently on different CPUs, so their values must not be
+// persisted. benchmarks/HashBenchmark.cpp compares their speed and
+// quality.
+
+inline uint64_t cuckooRead8(unsigned char const* p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t cuckooRead4(unsigned char const* p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// The high and low halves of a * b folded:
+inline uint64_t cuckooMum(uint64_t a, uint64_t b) {
+  unsigned __int128 r = static_cast<unsigned __int128>(a) * b;
+  return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+inline uint64_t wyHash64(void const* buf, size_t len, uint64_t seed) {
+  static constexpr uint64_t P0 = 0xa0761d6478bd642fULL;
+  static constexpr uint64_t P1 = 0xe7037ed1a0b428dbULL;
+  static constexpr uint64_t P2 = 0x8ebc6af09c88c6e3ULL;
+  auto p = static_cast<unsigned char const*>(buf);
+  seed ^= cuckooMum(seed ^ P0, P1);
+  uint64_t a;
+  uint64_t b;
+  if (len <= 16) {
+    if (len >= 4) {
+      size_t mid = (len >> 3) << 2;
+      a = (cuckooRead4(p) << 32) | cuckooRead4(p + mid);
+      b = (cuckooRead4(p + len - 4) << 32) | cuckooRead4(p + len - 4 - mid);
+    } else if (len > 0) {
+      a = (static_cast<uint64_t>(p[0]) << 16) |
+          (static_cast<uint64_t>(p[len >> 1]) << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    while (i > 16) {
+      seed = cuckooMum(cuckooRead8(p) ^ P1, cuckooRead8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = cuckooRead8(p + i - 16);
+    b = cuckooRead8(p + i - 8);
+  }
+  return cuckooMum(P1 ^ len, cuckooMum(a ^ P1, b ^ seed) ^ P2);
+}
+
+#if CUCKOO_HASH_X86
+
+inline bool cuckooCpuHasCrc32c() {
+#ifdef __SSE4_2__
+  return true;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+inline bool cuckooCpuHasAes() {
+#if defined(__AES__) && defined(__SSE4_1__)
+  return true;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+inline bool cuckooCpuHasAvx2() {
+#ifdef __AVX2__
+  return true;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+inline bool cuckooCpuHasAvx512() {
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+  return true;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f") &&
+         __builtin_cpu_supports("avx512dq");
+#endif
+}
+
+// Two CRC32C streams over the same words, the second one rotated so
+// that the two are not just affine images of each other:
+__attribute__((target("sse4.2"))) inline uint64_t crc32cHash64(
+    void const* buf, size_t len, uint64_t seed) {
+  auto p = static_cast<unsigned char const*>(buf);
+  uint64_t a = static_cast<uint32_t>(seed);
+  uint64_t b = static_cast<uint32_t>(seed >> 32) ^ len;
+  while (len >= 8) {
+    uint64_t v = cuckooRead8(p);
+    a = _mm_crc32_u64(a, v);
+    b = _mm_crc32_u64(b, (v << 32) | (v >> 32));
+    p += 8;
+    len -= 8;
+  }
+  if (len > 0) {
+    uint64_t v = 0;
+    std::memcpy(&v, p, len);
+    a = _mm_crc32_u64(a, v);
+    b = _mm_crc32_u64(b, (v << 32) | (v >> 32));
+  }
+  return cuckooFinalize((a << 32) | b);
+}
+
+__attribute__((target("aes,sse4.1"))) inline uint64_t aesHash64(
+    void const* buf, size_t len, uint64_t seed) {
+  auto p = static_cast<unsigned char const*>(buf);
+  __m128i key = _mm_set_epi64x(static_cast<long long>(seed ^ len),
+                               static_cast<long long>(~seed));
+  __m128i state = key;
+  while (len >= 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    state = _mm_aesenc_si128(_mm_xor_si128(state, block), key);
+    p += 16;
+    len -= 16;
+  }
+  if (len > 0) {
+    unsigned char tail[16] = {0};
+    std::memcpy(tail, p, len);
+    __m128i block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(tail));
+    state = _mm_aesenc_si128(_mm_xor_si128(state, block), key);
+  }
+  // Two more rounds spread every input byte over the whole state:
+  state = _mm_aesenc_si128(state, key);
+  state = _mm_aesenc_si128(state, key);
+  return static_cast<uint64_t>(_mm_cvtsi128_si64(state)) ^
+         static_cast<uint64_t>(_mm_extract_epi64(state, 1));
+}
+
+#else
+
+inline bool cuckooCpuHasCrc32c() { return false; }
+inline bool cuckooCpuHasAes() { return false; }
+inline bool cuckooCpuHasAvx2() { return false; }
+inline bool cuckooCpuHasAvx512() { return false; }
+
+inline uint64_t crc32cHash64(void const* buf, size_t len, uint64_t seed) {
+  return wyHash64(buf, len, seed);
+}
+
+inline uint64_t aesHash64(void const* buf, size_t len, uint64_t seed) {
+  return wyHash64(buf, len, seed);
+}
+
+#endif
+
+template <class T, uint64_t Seed>
+class WyHash {
+ public:
+  uint64_t operator()(T const& t) const {
+    return wyHash64(static_cast<void const*>(&t), sizeof(T), Seed);
+  }
+};
+
+template <class T, uint64_t Seed>
+class Crc32cHash {
+ public:
+  Crc32cHash() : _hardware(cuckooCpuHasCrc32c()) {}
+
+  uint64_t operator()(T const& t) const {
+    auto p = static_cast<void const*>(&t);
+    return _hardware ? crc32cHash64(p, sizeof(T), Seed)
+                     : wyHash64(p, sizeof(T), Seed);
+  }
+
+ private:
+  bool _hardware;
+};
+
+template <class T, uint64_t Seed>
+class AesHash {
+ public:
+  AesHash() : _hardware(cuckooCpuHasAes()) {}
+
+  uint64_t operator()(T const& t) const {
+    auto p = static_cast<void const*>(&t);
+    return _hardware ? aesHash64(p, sizeof(T), Seed)
+                     : wyHash64(p, sizeof(T), Seed);
+  }
+
+ private:
+  bool _hardware;
+};
+
+// Dietzfelbinger's multiply-shift with 128-bit multiplier and addend,
+// (A * x + B) >> 64, for keys of at most 8 bytes. The cheapest of all,
+// universal but without avalanche in the low bits of the result; the
+// cuckoo maps take their buckets from the middle bits.
+template <class T, uint64_t Seed>
+class MultiplyShiftHash {
+  static_assert(sizeof(T) <= 8 && std::is_trivially_copyable<T>::value,
+                "MultiplyShiftHash is for trivially copyable keys of at "
+                "most 8 bytes");
+
+ public:
+  MultiplyShiftHash() {
+    uint64_t s = Seed;
+    uint64_t a1 = cuckooFinalize(s += 0x9e3779b97f4a7c15ULL);
+    uint64_t a2 = cuckooFinalize(s += 0x9e3779b97f4a7c15ULL);
+    uint64_t b1 = cuckooFinalize(s += 0x9e3779b97f4a7c15ULL);
+    uint64_t b2 = cuckooFinalize(s += 0x9e3779b97f4a7c15ULL);
+    _a = (static_cast<unsigned __int128>(a1) << 64) | (a2 | 1);
+    _b = (static_cast<unsigned __int128>(b1) << 64) | b2;
+  }
+
+  uint64_t operator()(T const& t) const {
+    uint64_t x = 0;
+    std::memcpy(&x, &t, sizeof(T));
+    return static_cast<uint64_t>((_a * x + _b) >> 64);
+  }
+
+ private:
+  unsigned __int128 _a;
+  unsigned __int128 _b;
+};
+
+// Picks the fastest hash with hardware support when constructed:
+template <class T, uint64_t Seed>
+class DispatchHash {
+ public:
+  enum Kind { Aes, Crc32c, Wy };
+
+  DispatchHash()
+      : _kind(cuckooCpuHasAes() ? Aes : cuckooCpuHasCrc32c() ? Crc32c : Wy) {}
+
+  uint64_t operator()(T const& t) const {
+    auto p = static_cast<void const*>(&t);
+    switch (_kind) {
+      case Aes:
+        return aesHash64(p, sizeof(T), Seed);
+      case Crc32c:
+        return crc32cHash64(p, sizeof(T), Seed);
+      default:
+        return wyHash64(p, sizeof(T), Seed);
+    }
+  }
+
+  Kind kind() const { return _kind; }
+
+ private:
+  Kind _kind;
+};
+
+// BatchHash reads a trivially copyable T as 8-byte words (the last one
+// zero-padded) and uses only 64-bit multiplies, xors and shifts, so that
+// hashBatch<Seed>(keys, n, out1, out2) can hash 4 (AVX2) or 8 (AVX-512)
+// keys per instruction stream, picked at runtime. It stores the two hashes
+// of CuckooHashPair(BatchHash<T, Seed>()(keys[i])) in out1[i] and out2[i]
+// (out2 may be null), that is what SplitHash1 and SplitHash2 of BatchHash
+// return. The lookupCopyBatch of CuckooMap and ShardedMap use it through
+// CuckooBatchHasher if the map hashes with BatchHash.
+
+static constexpr uint64_t CuckooBatchMul = 0x9fb21c651e98df25ULL;
+
+inline uint64_t cuckooBatchStart(uint64_t seed, size_t len) {
+  return seed ^ (len * 0x9e3779b97f4a7c15ULL);
+}
+
+inline uint64_t cuckooBatchStep(uint64_t h, uint64_t word) {
+  h = (h ^ word) * CuckooBatchMul;
+  return h ^ (h >> 29);
+}
+
+// Word w of t:
+template <class T>
+inline uint64_t cuckooKeyWord(T const& t, size_t w) {
+  uint64_t v = 0;
+  size_t offset = w * 8;
+  std::memcpy(&v, reinterpret_cast<unsigned char const*>(&t) + offset,
+              sizeof(T) - offset < 8 ? sizeof(T) - offset : 8);
+  return v;
+}
+
+template <class T, uint64_t Seed>
+class BatchHash {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "BatchHash is for trivially copyable keys");
+
+ public:
+  static constexpr size_t Words = (sizeof(T) + 7) / 8;
+
+  uint64_t operator()(T const& t) const {
+    uint64_t h = cuckooBatchStart(Seed, sizeof(T));
+    for (size_t w = 0; w < Words; ++w) {
+      h = cuckooBatchStep(h, cuckooKeyWord(t, w));
+    }
+    return cuckooFinalize(h);
+  }
+};
+
+template <uint64_t Seed, class T>
+void hashBatchScalar(T const* keys, size_t n, uint64_t* out1,
+                     uint64_t* out2) {
+  BatchHash<T, Seed> hash;
+  for (size_t i = 0; i < n; ++i) {
+    CuckooHashPair pair(hash(keys[i]));
+    out1[i] = pair.hash1;
+    if (out2 != nullptr) {
+      out2[i] = pair.hash2;
+    }
+  }
+}
+
+#if CUCKOO_HASH_X86
+
+// AVX2 has no 64-bit multiply, it is put together from three 32-bit ones:
+__attribute__((target("avx2"))) inline __m256i cuckooMul64x4(__m256i a,
+                                                             __m256i b) {
+  __m256i cross =
+      _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                       _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(_mm256_mul_epu32(a, b),
+                          _mm256_slli_epi64(cross, 32));
+}
+
+template <int Shift>
+__attribute__((target("avx2"))) inline __m256i cuckooXorShiftx4(__m256i h) {
+  return _mm256_xor_si256(h, _mm256_srli_epi64(h, Shift));
+}
+
+template <uint64_t Seed, class T>
+__attribute__((target("avx2"))) void hashBatchAvx2(T const* keys, size_t n,
+                                                   uint64_t* out1,
+                                                   uint64_t* out2) {
+  static constexpr size_t Lanes = 4;
+  __m256i const mul = _mm256_set1_epi64x(CuckooBatchMul);
+  __m256i const fin1 = _mm256_set1_epi64x(0xff51afd7ed558ccdULL);
+  __m256i const fin2 = _mm256_set1_epi64x(0xc4ceb9fe1a85ec53ULL);
+  __m256i const golden = _mm256_set1_epi64x(0x9e3779b97f4a7c15ULL);
+  __m256i const mixMul = _mm256_set1_epi64x(0x2127599bf4325c37ULL);
+  size_t i = 0;
+  for (; i + Lanes <= n; i += Lanes) {
+    __m256i h = _mm256_set1_epi64x(cuckooBatchStart(Seed, sizeof(T)));
+    for (size_t w = 0; w < BatchHash<T, Seed>::Words; ++w) {
+      __m256i word;
+      if (sizeof(T) == 8) {  // the words of the lanes are adjacent
+        word = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(keys + i));
+      } else if (sizeof(T) == 4) {
+        word = _mm256_cvtepu32_epi64(
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(keys + i)));
+      } else {
+        word = _mm256_set_epi64x(
+            cuckooKeyWord(keys[i + 3], w), cuckooKeyWord(keys[i + 2], w),
+            cuckooKeyWord(keys[i + 1], w), cuckooKeyWord(keys[i], w));
+      }
+      h = cuckooXorShiftx4<29>(cuckooMul64x4(_mm256_xor_si256(h, word), mul));
+    }
+    h = cuckooMul64x4(cuckooXorShiftx4<33>(h), fin1);
+    h = cuckooMul64x4(cuckooXorShiftx4<33>(h), fin2);
+    h = cuckooXorShiftx4<33>(h);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out1 + i), h);
+    if (out2 != nullptr) {
+      h = cuckooXorShiftx4<23>(_mm256_xor_si256(h, golden));
+      h = cuckooXorShiftx4<47>(cuckooMul64x4(h, mixMul));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out2 + i), h);
+    }
+  }
+  hashBatchScalar<Seed>(keys + i, n - i, out1 + i,
+                        out2 != nullptr ? out2 + i : nullptr);
+}
+
+// The zero-masking shift, since GCC 12 warns about the undefined source
+// of the plain one (the same for the conversion below):
+template <int Shift>
+__attribute__((target("avx512f,avx512dq"))) inline __m512i cuckooXorShiftx8(
+    __m512i h) {
+  return _mm512_xor_si512(
+      h, _mm512_maskz_srli_epi64(static_cast<__mmask8>(0xff), h, Shift));
+}
+
+template <uint64_t Seed, class T>
+__attribute__((target("avx512f,avx512dq"))) void hashBatchAvx512(
+    T const* keys, size_t n, uint64_t* out1, uint64_t* out2) {
+  static constexpr size_t Lanes = 8;
+  __m512i const mul = _mm512_set1_epi64(CuckooBatchMul);
+  __m512i const fin1 = _mm512_set1_epi64(0xff51afd7ed558ccdULL);
+  __m512i const fin2 = _mm512_set1_epi64(0xc4ceb9fe1a85ec53ULL);
+  __m512i const golden = _mm512_set1_epi64(0x9e3779b97f4a7c15ULL);
+  __m512i const mixMul = _mm512_set1_epi64(0x2127599bf4325c37ULL);
+  size_t i = 0;
+  for (; i + Lanes <= n; i += Lanes) {
+    __m512i h = _mm512_set1_epi64(cuckooBatchStart(Seed, sizeof(T)));
+    for (size_t w = 0; w < BatchHash<T, Seed>::Words; ++w) {
+      __m512i word;
+      if (sizeof(T) == 8) {
+        word = _mm512_loadu_si512(keys + i);
+      } else if (sizeof(T) == 4) {
+        word = _mm512_maskz_cvtepu32_epi64(
+            static_cast<__mmask8>(0xff),
+            _mm256_loadu_si256(reinterpret_cast<__m256i const*>(keys + i)));
+      } else {
+        alignas(64) uint64_t words[Lanes];
+        for (size_t j = 0; j < Lanes; ++j) {
+          words[j] = cuckooKeyWord(keys[i + j], w);
+        }
+        word = _mm512_load_si512(words);
+      }
+      h = cuckooXorShiftx8<29>(
+          _mm512_mullo_epi64(_mm512_xor_si512(h, word), mul));
+    }
+    h = _mm512_mullo_epi64(cuckooXorShiftx8<33>(h), fin1);
+    h = _mm512_mullo_epi64(cuckooXorShiftx8<33>(h), fin2);
+    h = cuckooXorShiftx8<33>(h);
+    _mm512_storeu_si512(out1 + i, h);
+    if (out2 != nullptr) {
+      h = cuckooXorShiftx8<23>(_mm512_xor_si512(h, golden));
+      h = cuckooXorShiftx8<47>(_mm512_mullo_epi64(h, mixMul));
+      _mm512_storeu_si512(out2 + i, h);
+    }
+  }
+  hashBatchScalar<Seed>(keys + i, n - i, out1 + i,
+                        out2 != nullptr ? out2 + i : nullptr);
+}
+
+#endif
+
+// 2 for AVX-512, 1 for AVX2, 0 for neither, checked once:
+inline int cuckooBatchLevel() {
+  static int const level =
+      cuckooCpuHasAvx512() ? 2 : cuckooCpuHasAvx2() ? 1 : 0;
+  return level;
+}
+
+// The kernels are only picked for keys of 4 or 8 bytes, which they load
+// straight into the lanes. Wider keys have to be transposed word by word,
+// which costs more than hashing them one by one (see HashBenchmark):
+template <uint64_t Seed, class T>
+void hashBatch(T const* keys, size_t n, uint64_t* out1, uint64_t* out2) {
+#if CUCKOO_HASH_X86
+  switch (sizeof(T) == 4 || sizeof(T) == 8 ? cuckooBatchLevel() : 0) {
+    case 2:
+      return hashBatchAvx512<Seed>(keys, n, out1, out2);
+    case 1:
+      return hashBatchAvx2<Seed>(keys, n, out1, out2);
+    default:
+      break;
+  }
+#endif
+  hashBatchScalar<Seed>(keys, n, out1, out2);
+}
+
+// The batch hashing of maps hashing with BatchHash, see CuckooHelpers.h:
+template <class T, uint64_t Seed>
+struct CuckooBatchHasher<SplitHash1<BatchHash<T, Seed>>,
+                         SplitHash2<BatchHash<T, Seed>>> {
+  static void hash(SplitHash1<BatchHash<T, Seed>>&,
+                   SplitHash2<BatchHash<T, Seed>>&, T const* keys, size_t n,
+                   uint64_t* out1, uint64_t* out2) {
+    hashBatch<Seed>(keys, n, out1, out2);
+  }
+};
+
+template <class T, uint64_t Seed1, uint64_t Seed2>
+struct CuckooBatchHasher<BatchHash<T, Seed1>, BatchHash<T, Seed2>> {
+  static void hash(BatchHash<T, Seed1>&, BatchHash<T, Seed2>&,
+                   T const* keys, size_t n, uint64_t* out1, uint64_t* out2) {
+    hashBatch<Seed1>(keys, n, out1, nullptr);
+    hashBatch<Seed2>(keys, n, out2, nullptr);
+  }
+};
+
+template <class T, uint64_t Seed>
+struct CuckooBatchHasher<BatchHash<T, Seed>, SingleHash> {
+  static void hash(BatchHash<T, Seed>&, SingleHash&, T const* keys, size_t n,
+                   uint64_t* out1, uint64_t* out2) {
+    hashBatch<Seed>(keys, n, out1, nullptr);
+    for (size_t i = 0; i < n; ++i) {
+      out2[i] = 0;
+    }
+  }
+};
+
+#endif
@@ -1,19 +1,24 @@
 #ifndef CUCKOO_HELPERS_H
 #define CUCKOO_HELPERS_H 1
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <mutex>
+#include <random>
+#include <type_traits>
 
 // For fasthash64:
-static inline uint64_t mix(uint64_t h) {
+inline uint64_t mix(uint64_t h) {
   h ^= h >> 23;
   h *= 0x2127599bf4325c37ULL;
   h ^= h >> 47;
   return h;
 }
 
-// A default hash function:
-uint64_t fasthash64(const void* buf, size_t len, uint64_t seed) {
+// A default hash function, see CuckooHashes.h for faster ones:
+inline uint64_t fasthash64(const void* buf, size_t len, uint64_t seed) {
   uint64_t const m = 0x880355f21e6d1965ULL;
   uint64_t const* pos = (uint64_t const*)buf;
   uint64_t const* end = pos + (len / 8);
@@ -52,6 +57,34 @@ uint64_t fasthash64(const void* buf, size_t len, uint64_t seed) {
   return mix(h);
 }
 
+// Final mix with full avalanche (from MurmurHash3), also mixes the seeds
+// of InternalCuckooMap into hashes:
+inline uint64_t cuckooFinalize(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// A nonzero seed for InternalCuckooMap which input cannot be chosen to
+// collide under. std::random_device may throw or be deterministic on some
+// platforms, so the clock and a counter are mixed in as well:
+inline uint64_t cuckooRandomSeed() {
+  static std::atomic<uint64_t> counter(0);
+  uint64_t seed = static_cast<uint64_t>(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+  seed ^= counter.fetch_add(0x9e3779b97f4a7c15ULL, std::memory_order_relaxed);
+  try {
+    std::random_device device;
+    seed ^= (static_cast<uint64_t>(device()) << 32) ^ device();
+  } catch (...) {
+  }
+  seed = cuckooFinalize(seed);
+  return seed != 0 ? seed : 1;
+}
+
 // C++ wrapper for the hash function:
 template <class T, uint64_t Seed>
 class HashWithSeed {
@@ -64,6 +97,87 @@ class HashWithSeed {
   }
 };
 
+// The two hashes of a key, for the ByHash operations of CuckooMap and
+// ShardedMap. A single 64-bit hash is split into two by remixing it:
+struct CuckooHashPair {
+  uint64_t hash1;
+  uint64_t hash2;
+
+  CuckooHashPair(uint64_t h1, uint64_t h2) : hash1(h1), hash2(h2) {}
+  explicit CuckooHashPair(uint64_t h)
+      : hash1(h), hash2(mix(h ^ 0x9e3779b97f4a7c15ULL)) {}
+};
+
+// Hash functors splitting the single hash of Hash like CuckooHashPair, so
+// that a map whose callers already have that hash can take it in the
+// ByHash operations:
+template <class Hash>
+struct SplitHash1 {
+  mutable Hash hash;
+  template <class T>
+  uint64_t operator()(T const& t) const {
+    return CuckooHashPair(hash(t)).hash1;
+  }
+};
+
+template <class Hash>
+struct SplitHash2 {
+  mutable Hash hash;
+  template <class T>
+  uint64_t operator()(T const& t) const {
+    return CuckooHashPair(hash(t)).hash2;
+  }
+};
+
+// Hashes n keys for the batch operations of CuckooMap and ShardedMap,
+// one by one unless specialized (see BatchHash in CuckooHashes.h):
+template <class HashKey1, class HashKey2>
+struct CuckooBatchHasher {
+  template <class Key>
+  static void hash(HashKey1& hasher1, HashKey2& hasher2, Key const* keys,
+                   size_t n, uint64_t* out1, uint64_t* out2) {
+    for (size_t i = 0; i < n; ++i) {
+      out1[i] = hasher1(keys[i]);
+      out2[i] = hasher2(keys[i]);
+    }
+  }
+};
+
+// HashKey2 of a map which derives the second bucket of a key from the
+// hash of HashKey1 instead of hashing the key again, see
+// InternalCuckooMap. It is never called:
+struct SingleHash {
+  typedef void is_transparent;
+  template <class T>
+  uint64_t operator()(T const&) const {
+    return 0;
+  }
+};
+
+template <class Hash>
+struct IsSingleHash : std::is_same<Hash, SingleHash> {};
+
+template <class T>
+struct CuckooVoid {
+  typedef void type;
+};
+
+// Whether a hash or comparison functor declares is_transparent, that is,
+// also accepts other types than the key type:
+template <class F, class = void>
+struct IsTransparent : std::false_type {};
+
+template <class F>
+struct IsTransparent<F, typename CuckooVoid<typename F::is_transparent>::type>
+    : std::true_type {};
+
+// Enables heterogeneous overloads taking a K instead of a key, if both
+// hashes and the comparison are transparent (depends on K for SFINAE):
+template <class HashKey1, class HashKey2, class CompKey, class K>
+using EnableIfTransparent = typename std::enable_if<
+    IsTransparent<HashKey1>::value && IsTransparent<HashKey2>::value &&
+    IsTransparent<CompKey>::value && sizeof(K) != 0>::type;
+
 class MyMutexGuard {
   std::mutex& _mutex;
   bool _locked;
@@ -75,12 +189,9 @@ class MyMutexGuard {
       _mutex.unlock();
     }
   }
-  void release() {
-    if (_locked) {
-      _locked = false;
-      _mutex.unlock();
-    }
-  }
+  // Give up ownership without unlocking, the caller becomes responsible
+  // for unlocking the mutex (as with std::unique_lock::release()):
+  void release() { _locked = false; }
 };
 
 #endif
@@ -1,22 +1,36 @@
 #ifndef CUCKOO_MAP_H
 #define CUCKOO_MAP_H 1
 
-#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "CuckooCoroutines.h"
+#include "CuckooStatistics.h"
+#include "CuckooTracing.h"
+#include "EpochReclamation.h"
 #include "InternalCuckooMap.h"
 
 // In the following template:
-//   Key is the key type, it must be copyable and movable, furthermore, Key
+//   Key is the key type, it must be movable, furthermore, Key
 //     must be default constructible (without arguments) as empty and
 //     must have an empty() method to indicate that the instance is
 //     empty. If using fasthash64 on all bytes of the object is not
 //     a suitable hash function, one has to instanciate the template
 //     with two hash function types as 3rd and 4th argument. If
 //     std::equal_to<Key> is not implemented or does not behave
-//     correctly, one has to supply a comparison class as well.
+//     correctly, one has to supply a comparison class as well. Keys
+//     are only copied by the operations taking a Key const& to insert,
+//     move-only keys can be inserted with insert(Key&&, ...) and
+//     emplace(). Within the table keys are only moved.
 //   Value is the value type, it is not actually used anywhere in the
 //     template except as Value* for input and output of values. The
 //     template parameter basically only serves as a convenience to
@@ -31,11 +45,68 @@
 // keeps a mutex until it is destroyed. This for example allows to change
 // values that are actually currently stored in the map. Keys must only be
 // changed as long as their hash and fingerprint does not change!
+// insert(k, v) and remove(k) without a Finding do not take that mutex but
+// only lock the buckets they touch (striped bucket locks per layer), so
+// that they run concurrently with each other. Holding a Finding excludes
+// them.
+// Unless compiled with -DCUCKOO_MAP_STATISTICS=0, the map counts lookups,
+// promotions, evictions, new layers and mutex waits, see stats(). Cascade
+// events and the mutex are traced with static probes, see CuckooTracing.h.
+// For trivially copyable keys, lookupCopy() and lookupOptimistic() read
+// without taking the mutex, see there. visit() and update() run a callback
+// on a value with only its buckets locked, which is usually preferable to
+// holding a Finding.
+// If HashKey1, HashKey2 and CompKey all define is_transparent, lookups,
+// visits and removes also take any other type the functors accept (for
+// example a std::string_view for a std::string key, or a number for a
+// struct wrapping it), without constructing a Key. The functors must then
+// hash such a probe exactly like the equal Key.
+// The slots per bucket of all layers are a template parameter, see
+// InternalCuckooMap, the growth of the cascade and the promotion of pairs
+// found in later layers are set at runtime with a CuckooMapPolicy.
+// A key is hashed once per operation for all layers. With StoreTags its
+// slots keep the hashes of the pairs (see InternalCuckooMap), so that
+// pairs expunged on the way through the cascade are never hashed again.
+// Keys which collide in the bits the layers pick buckets by (a weak hash,
+// or input chosen against the fixed seeds of the default hashes) would
+// otherwise overflow every layer while it is nearly empty and make the
+// cascade ever taller. An insert which finds layers passing pairs on
+// while mostly empty therefore rehashes them in place with a random seed
+// afterwards, see CuckooMapPolicy::rehashBelowLoad. With randomSeeds
+// every layer gets a random seed from the start.
+
+// Runtime tuning knobs of a CuckooMap, see benchmarks/CuckooTuner.cpp:
+struct CuckooMapPolicy {
+  enum Promotion {
+    PromoteAlways,  // a lookup hit moves its pair to the first layer
+    PromoteNever    // pairs stay in the layer they were inserted into
+  };
+
+  uint32_t growthFactor;  // every new layer is this many times larger
+  Promotion promotion;
+  // A layer which is less full than this when a pair has to be moved on
+  // from it to a new layer is rehashed with a random seed, 0 never does.
+  // Except for the last one, layers are nearly full by then if the hashes
+  // spread the keys.
+  double rehashBelowLoad;
+  bool randomSeeds;  // seed every layer randomly, not only rehashed ones
+  // An insert which would need more layers than this throws
+  // std::length_error and leaves the map as it was. At most 64.
+  uint32_t maxLayers;
+
+  CuckooMapPolicy()
+      : growthFactor(4),
+        promotion(PromoteAlways),
+        rehashBelowLoad(0.25),
+        randomSeeds(false),
+        maxLayers(64) {}
+};
 
 template <class Key, class Value,
           class HashKey1 = HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
           class HashKey2 = HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
-          class CompKey = std::equal_to<Key>>
+          class CompKey = std::equal_to<Key>, uint32_t SlotsPerBucket = 2,
+          bool StoreTags = false>
 class CuckooMap {
  public:
   typedef Key KeyType;  // these are for ShardedMap
@@ -43,28 +114,90 @@ class CuckooMap {
   typedef HashKey1 HashKey1Type;
   typedef HashKey2 HashKey2Type;
   typedef CompKey CompKeyType;
-  typedef InternalCuckooMap<Key, Value, HashKey1, HashKey2, CompKey> Subtable;
+  typedef CuckooMapPolicy PolicyType;
+  typedef InternalCuckooMap<Key, Value, HashKey1, HashKey2, CompKey,
+                            SlotsPerBucket, StoreTags>
+      Subtable;
 
  private:
+  // The most CuckooMapPolicy::maxLayers allows, with a growth factor of
+  // at least 2 the layers could not be allocated anyway:
+  static constexpr uint32_t MaxLayers = 64;
+  static constexpr uint32_t MaxOptimisticAttempts = 64;
+  // Random seeds rehashLayer tries before it gives up on a layer:
+  static constexpr uint32_t MaxReseeds = 4;
+  // Bucket locks of a layer are striped over at most this many words:
+  static constexpr uint64_t MaxStripes = 1024;
+  // prefetch() only looks at this many layers, most hits are there:
+  static constexpr uint32_t PrefetchLayers = 2;
+  // lookupCopyBatch hashes and prefetches this many keys at a time:
+  static constexpr size_t BatchSize = 16;
+
+  class StripeSet;
+  class SharedGuard;
+
+  // A layer of the cascade with its bucket locks, bucket b is covered by
+  // stripe b & stripeMask. A stripe is a versioned spinlock, odd while it
+  // is held, so that lock-free readers can validate against it.
+  struct Layer : public Subtable {
+    std::unique_ptr<std::atomic<uint64_t>[]> stripes;
+    uint64_t stripeMask;
+
+    Layer(uint64_t size, size_t valueSize, size_t valueAlign, uint64_t seed)
+        : Subtable(size, valueSize, valueAlign, seed) {
+      uint64_t n =
+          this->nrBuckets() < MaxStripes ? this->nrBuckets() : MaxStripes;
+      stripes.reset(new std::atomic<uint64_t>[n]);
+      for (uint64_t i = 0; i < n; ++i) {
+        stripes[i].store(0, std::memory_order_relaxed);
+      }
+      stripeMask = n - 1;
+    }
+
+    std::atomic<uint64_t>& stripe(uint64_t bucket) {
+      return stripes[bucket & stripeMask];
+    }
+
+    uint64_t memoryUsage() {
+      return Subtable::memoryUsage() + sizeof(Layer) - sizeof(Subtable) +
+             (stripeMask + 1) * sizeof(std::atomic<uint64_t>);
+    }
+  };
+
   size_t _firstSize;
   size_t _valueSize;
   size_t _valueAlign;
+  CuckooMapPolicy _policy;
   CompKey _compKey;
+  HashKey1 _hasher1;  // only for lookupCopyBatch, the layers hash themselves
+  HashKey2 _hasher2;
 
  public:
   CuckooMap(size_t firstSize, size_t valueSize = sizeof(Value),
-            size_t valueAlign = alignof(Value))
+            size_t valueAlign = alignof(Value),
+            CuckooMapPolicy const& policy = CuckooMapPolicy())
       : _firstSize(firstSize),
         _valueSize(valueSize),
         _valueAlign(valueAlign),
-        _nrUsed(0) {
-    auto t = new Subtable(firstSize, valueSize, valueAlign);
-    try {
-      _tables.emplace_back(t);
-    } catch (...) {
-      delete t;
-      throw;
+        _policy(policy),
+        _version(0),
+        _nrLayers(0),
+        _exclusive(false),
+        _sharedWriters(0),
+        _nrUsed(0),
+        _flooded(0),
+        _seedNewLayers(false) {
+    if (_policy.growthFactor < 2) {
+      _policy.growthFactor = 2;
+    }
+    if (_policy.maxLayers < 1 || _policy.maxLayers > MaxLayers) {
+      _policy.maxLayers = MaxLayers;
+    }
+    _tables.reserve(MaxLayers);  // so appending a layer cannot throw
+    for (uint32_t layer = 0; layer < MaxLayers; ++layer) {
+      _layers[layer].store(nullptr, std::memory_order_relaxed);
     }
+    appendLayer(new Layer(firstSize, valueSize, valueAlign, newSeed()));
   }
 
   struct Finding {
@@ -109,22 +242,19 @@ class CuckooMap {
     // Allow moving, we need this to allow for copy elision where we
     // return by value:
    public:
-    Finding(Finding&& other) {
-      std::cout << "move" << std::endl;
-      if (_map != nullptr) {
-        _map->release();
-      }
-      _map = other._map;
+    Finding(Finding&& other)
+        : _key(other._key),
+          _value(other._value),
+          _map(other._map),
+          _layer(other._layer) {
       other._map = nullptr;
-
-      _key = other._key;
-      _value = other._value;
-      _layer = other._layer;
       other._key = nullptr;
     }
 
     Finding& operator=(Finding&& other) {
-      std::cout << "move assign" << std::endl;
+      if (this == &other) {
+        return *this;
+      }
       if (_map != nullptr) {
         _map->release();
       }
@@ -166,18 +296,23 @@ class CuckooMap {
     //       // work with *res.key() and *res.value()
     //     }
     //   }
-    MyMutexGuard guard(_mutex);
-    Finding f(nullptr, nullptr, this, -1);
-    innerLookup(k, f);
-    guard.release();
-    return f;
+    return lookupAny(k);
+  }
+
+  // Heterogeneous lookup, see the top of this file:
+  template <class K,
+            class = EnableIfTransparent<HashKey1, HashKey2, CompKey, K>>
+  Finding lookup(K const& k) {
+    return lookupAny(k);
   }
 
   bool lookup(Key const& k, Finding& f) {
     if (f._map != this) {
-      f._map->_mutex.unlock();
+      if (f._map != nullptr) {
+        f._map->release();
+      }
       f._map = this;
-      _mutex.lock();
+      lock();
     }
     f._key = nullptr;
     innerLookup(k, f);
@@ -188,38 +323,257 @@ class CuckooMap {
     // inserts a pair (k, v) into the table
     // returns true if the insertion took place and false if there was
     // already a pair with the same key k in the table, in which case
-    // the table is unchanged.
-    MyMutexGuard guard(_mutex);
-    return innerInsert(k, v, nullptr);
+    // the table is unchanged. Only the buckets on the way are locked.
+    return stripedInsert(k, v);
+  }
+
+  // As above, but k is moved into the table instead of copied. k is
+  // moved from, even if there already is a pair with key k.
+  bool insert(Key&& k, Value const* v) {
+    return stripedInsert(std::move(k), v);
+  }
+
+  // Constructs the key from keyArgs and moves it into the table:
+  template <class... Args>
+  bool emplace(Value const* v, Args&&... keyArgs) {
+    return insert(Key(std::forward<Args>(keyArgs)...), v);
   }
 
   bool insert(Key const& k, Value const* v, Finding& f) {
-    if (f._map != this) {
-      f._map->_mutex.unlock();
-      f._map = this;
-      _mutex.lock();
-    }
-    bool res = innerInsert(k, v, nullptr);
-    f._key = nullptr;
-    return res;
+    return insertWithFinding(k, v, f);
+  }
+
+  bool insert(Key&& k, Value const* v, Finding& f) {
+    return insertWithFinding(std::move(k), v, f);
+  }
+
+  // Calls visitor(Value const*) on the value of the pair with key k with
+  // only the buckets of k locked, and returns whether there is such a
+  // pair. The pair is not promoted. visitor must not use the map.
+  template <class Visitor>
+  bool visit(Key const& k, Visitor visitor) {
+    return visitAny(k, visitor);
+  }
+
+  template <class K, class Visitor,
+            class = EnableIfTransparent<HashKey1, HashKey2, CompKey, K>>
+  bool visit(K const& k, Visitor visitor) {
+    return visitAny(k, visitor);
+  }
+
+  // As visit, but updater(Value*) may change the value in place:
+  template <class Updater>
+  bool update(Key const& k, Updater updater) {
+    return updateAny(k, updater);
+  }
+
+  template <class K, class Updater,
+            class = EnableIfTransparent<HashKey1, HashKey2, CompKey, K>>
+  bool update(K const& k, Updater updater) {
+    return updateAny(k, updater);
+  }
+
+  // The following read-modify-write operations look through the cascade
+  // once with the buckets of k locked in every layer, so that nobody can
+  // insert k meanwhile, and then insert right away if k is missing. They
+  // return true if they inserted a pair and do not promote.
+
+  // Inserts (k, *v), or overwrites the value of the pair with key k:
+  bool insertOrAssign(Key const& k, Value const* v) {
+    auto assign = [this, v](Value* value) {
+      std::memcpy(value, v, _valueSize);
+    };
+    return findOrInsert(k, assign, assign);
+  }
+
+  // Inserts k with a Value constructed from args if there is no pair with
+  // key k. Otherwise nothing happens, args are not even touched.
+  template <class... Args>
+  bool tryEmplace(Key const& k, Args&&... args) {
+    return findOrInsert(k, [](Value*) {}, [&](Value* fresh) {
+      new (fresh) Value(std::forward<Args>(args)...);
+    });
+  }
+
+  // Inserts k with the value which factory(Value*) writes, if there is no
+  // pair with key k. factory is only called in that case.
+  template <class Factory>
+  bool computeIfAbsent(Key const& k, Factory factory) {
+    return findOrInsert(k, [](Value*) {}, factory);
+  }
+
+  // Inserts (k, *v), or calls merge(Value* existing, Value const* v) to
+  // combine *v into the value of the pair with key k:
+  template <class Merge>
+  bool upsert(Key const& k, Value const* v, Merge merge) {
+    return findOrInsert(k, [v, &merge](Value* value) { merge(value, v); },
+                        [this, v](Value* fresh) {
+                          std::memcpy(fresh, v, _valueSize);
+                        });
+  }
+
+  // Atomic operations on a field of the value of the pair with key k,
+  // typically a counter:
+  //   map.fetchAdd(k, &Value::hits, uint64_t(1));
+  // The buckets of k stay locked meanwhile, which pins the pair: no kick,
+  // promotion or remove can move it away under the update. The update
+  // itself is a single atomic instruction on the slot, so lock-free
+  // readers never see a torn field. T must be an integral type. These
+  // return false if there is no pair with key k, and otherwise store the
+  // previous value of the field in *previous if given.
+
+  template <class T>
+  bool fetchAdd(Key const& k, T Value::*field, T delta,
+                T* previous = nullptr) {
+    static_assert(std::is_integral<T>::value, "fetchAdd needs an integer");
+    SharedGuard guard(*this);
+    return withLockedPair(k, [&](Layer&, Key*, Value* value) {
+      T old = __atomic_fetch_add(&(value->*field), delta, __ATOMIC_SEQ_CST);
+      if (previous != nullptr) {
+        *previous = old;
+      }
+    });
+  }
+
+  template <class T>
+  bool fetchOr(Key const& k, T Value::*field, T bits, T* previous = nullptr) {
+    static_assert(std::is_integral<T>::value, "fetchOr needs an integer");
+    SharedGuard guard(*this);
+    return withLockedPair(k, [&](Layer&, Key*, Value* value) {
+      T old = __atomic_fetch_or(&(value->*field), bits, __ATOMIC_SEQ_CST);
+      if (previous != nullptr) {
+        *previous = old;
+      }
+    });
+  }
+
+  // Sets the field to desired if it equals expected and returns true.
+  // Otherwise returns false and sets expected to the current value of the
+  // field, which is left alone if there is no pair with key k.
+  template <class T>
+  bool compareExchange(Key const& k, T Value::*field, T& expected,
+                       T desired) {
+    static_assert(std::is_integral<T>::value,
+                  "compareExchange needs an integer");
+    SharedGuard guard(*this);
+    bool exchanged = false;
+    withLockedPair(k, [&](Layer&, Key*, Value* value) {
+      exchanged = __atomic_compare_exchange_n(&(value->*field), &expected,
+                                              desired, false, __ATOMIC_SEQ_CST,
+                                              __ATOMIC_SEQ_CST);
+    });
+    return exchanged;
   }
 
   bool remove(Key const& k) {
     // remove the pair with key k, if one is in the table. Return true if
-    // a pair was removed and false otherwise.
-    Finding f = lookup(k);
-    if (f.found() == 0) {
-      return false;
+    // a pair was removed and false otherwise. Only the buckets of k are
+    // locked, one layer at a time.
+    return removeAny(k);
+  }
+
+  template <class K,
+            class = EnableIfTransparent<HashKey1, HashKey2, CompKey, K>>
+  bool remove(K const& k) {
+    return removeAny(k);
+  }
+
+#if CUCKOO_MAP_COROUTINES
+  // lookupCopy as a coroutine for interleaving, see CuckooCoroutines.h.
+  // It prefetches the buckets of k in every layer and suspends before it
+  // reads them, and copies the value to *v if found. v must outlive the
+  // task, k is copied.
+  CuckooLookupTask co_lookup(Key k, Value* v) {
+    static_assert(std::is_trivially_copyable<Key>::value,
+                  "lock-free lookups need a trivially copyable Key");
+    auto reader = [this, v](Value const* found) {
+      std::memcpy(v, found, _valueSize);
+    };
+    EpochGuard epoch;  // layers stay valid while suspended
+    CuckooHashPair h = hashesOf(k, nullptr);
+    for (uint32_t attempt = 0; attempt < MaxOptimisticAttempts; ++attempt) {
+      uint64_t version = _version.load(std::memory_order_acquire);
+      if ((version & 1) != 0) {
+        continue;  // a writer holds the mutex
+      }
+      // As findValidated, but suspending in every layer:
+      uint32_t n = _nrLayers.load(std::memory_order_acquire);
+      int found = 0;
+      for (uint32_t layer = 0; layer < n && found == 0; ++layer) {
+        Layer* t = _layers[layer].load(std::memory_order_acquire);
+        if (t == nullptr) {
+          found = -1;  // retired meanwhile
+          break;
+        }
+        uint64_t pos1, pos2;
+        buckets(*t, h, pos1, pos2);
+        t->prefetchBuckets(pos1, pos2);
+        co_await std::suspend_always();
+        found = findValidatedInBuckets(*t, k, pos1, pos2, reader);
+      }
+      if (found == 0 && _nrLayers.load(std::memory_order_acquire) != n) {
+        found = -1;
+      }
+      if (found < 0) {
+        continue;
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (_version.load(std::memory_order_relaxed) == version) {
+        co_return found > 0;
+      }
     }
-    innerRemove(f);
-    return true;
+    LockGuard guard(*this);
+    Value* found = findInLayers(k);
+    if (found != nullptr) {
+      reader(found);
+    }
+    co_return found != nullptr;
+  }
+#endif
+
+  // Hints the CPU to load the buckets of k in the first layers into the
+  // cache, for example a few keys ahead of their lookups. Neither locks
+  // nor changes anything, nor counts in stats().
+  void prefetch(Key const& k) { prefetchAny(k, nullptr); }
+
+  // lookup, insert and remove (and prefetch and lookupCopy) with the
+  // hashes of k already computed by the caller. They must be what
+  // HashKey1 and HashKey2 return for k, since pairs are rehashed when they
+  // are expunged. A caller with a single hash of its own instantiates the
+  // map with SplitHash1 and SplitHash2 of a functor returning it and
+  // passes CuckooHashPair(hash), or with SingleHash as HashKey2, which
+  // ignores hash.hash2.
+  Finding lookupByHash(Key const& k, CuckooHashPair const& hash) {
+    return lookupAny(k, &hash);
+  }
+
+  bool insertByHash(Key const& k, Value const* v,
+                    CuckooHashPair const& hash) {
+    return stripedInsert(k, v, &hash);
+  }
+
+  void prefetchByHash(Key const& k, CuckooHashPair const& hash) {
+    prefetchAny(k, &hash);
+  }
+
+  bool lookupCopyByHash(Key const& k, Value* v, CuckooHashPair const& hash) {
+    auto reader = [this, v](Value const* found) {
+      std::memcpy(v, found, _valueSize);
+    };
+    return lookupOptimisticAny(k, reader, &hash);
+  }
+
+  bool removeByHash(Key const& k, CuckooHashPair const& hash) {
+    return removeAny(k, &hash);
   }
 
   bool remove(Finding& f) {
     if (f._map != this) {
-      f._map->_mutex.unlock();
+      if (f._map != nullptr) {
+        f._map->release();
+      }
       f._map = this;
-      _mutex.lock();
+      lock();
     }
     if (f._key == nullptr) {
       return false;
@@ -228,102 +582,935 @@ class CuckooMap {
     return true;
   }
 
-  uint64_t nrUsed() const {
-    MyMutexGuard guard(_mutex);
-    return _nrUsed;
+  // Lock-free lookup: copies the value of the pair with key k to *v and
+  // returns true, or returns false if there is no such pair. Readers do
+  // not block each other, but a pair found in a later layer is not
+  // promoted and the lookup is not counted in stats(). Only available if
+  // Key is trivially copyable.
+  bool lookupCopy(Key const& k, Value* v) {
+    auto reader = [this, v](Value const* found) {
+      std::memcpy(v, found, _valueSize);
+    };
+    return lookupOptimisticAny(k, reader);
+  }
+
+  template <class K,
+            class = EnableIfTransparent<HashKey1, HashKey2, CompKey, K>>
+  bool lookupCopy(K const& k, Value* v) {
+    auto reader = [this, v](Value const* found) {
+      std::memcpy(v, found, _valueSize);
+    };
+    return lookupOptimisticAny(k, reader);
+  }
+
+  // lookupCopy of keys[0..n), which copies the value of keys[i] to
+  // values[i] and sets found[i]. The keys are hashed BatchSize at a time,
+  // with the vectorized hashBatch if the map hashes with BatchHash (see
+  // CuckooHashes.h), and the buckets of all of them are prefetched before
+  // the first is read. Returns the number of keys found.
+  size_t lookupCopyBatch(Key const* keys, size_t n, Value* values,
+                         bool* found) {
+    uint64_t hash1[BatchSize];
+    uint64_t hash2[BatchSize];
+    size_t hits = 0;
+    for (size_t start = 0; start < n; start += BatchSize) {
+      size_t m = n - start < BatchSize ? n - start : BatchSize;
+      CuckooBatchHasher<HashKey1, HashKey2>::hash(
+          _hasher1, _hasher2, keys + start, m, hash1, hash2);
+      for (size_t i = 0; i < m; ++i) {
+        prefetchByHash(keys[start + i], CuckooHashPair(hash1[i], hash2[i]));
+      }
+      for (size_t i = 0; i < m; ++i) {
+        bool f = lookupCopyByHash(keys[start + i], &values[start + i],
+                                  CuckooHashPair(hash1[i], hash2[i]));
+        found[start + i] = f;
+        hits += f ? 1 : 0;
+      }
+    }
+    return hits;
+  }
+
+  // Lock-free lookup which lets reader look at the value of the pair with
+  // key k in place, returns whether there is such a pair. The layers are
+  // protected by an EpochGuard, and the map version is validated
+  // afterwards against concurrent changes (a Finding makes the version of
+  // the map odd, an insert or remove the bucket locks it holds), so
+  // reader may be called more than once and may see a value which is
+  // being changed. It must therefore only copy the bytes of the value
+  // somewhere, the last copy is the valid one. After a number of failed
+  // attempts the lookup falls back to taking the mutex. CompKey must not
+  // follow pointers in keys, it may be called on a key which is being
+  // overwritten.
+  template <class Reader>
+  bool lookupOptimistic(Key const& k, Reader reader) {
+    return lookupOptimisticAny(k, reader);
+  }
+
+  template <class K, class Reader,
+            class = EnableIfTransparent<HashKey1, HashKey2, CompKey, K>>
+  bool lookupOptimistic(K const& k, Reader reader) {
+    return lookupOptimisticAny(k, reader);
+  }
+
+  uint64_t nrUsed() const { return _nrUsed.load(std::memory_order_relaxed); }
+
+  uint32_t nrLayers() const {
+    LockGuard guard(*this);
+    return static_cast<uint32_t>(_tables.size());
+  }
+
+  // Bytes used by the map itself and all its layers:
+  uint64_t memoryUsage() const {
+    LockGuard guard(*this);
+    uint64_t res = sizeof(CuckooMap) +
+                   _tables.capacity() * sizeof(std::unique_ptr<Layer>);
+    for (auto const& sub : _tables) {
+      res += sub->memoryUsage();
+    }
+    return res;
+  }
+
+  // Returns a snapshot of the sizes of all layers and of the statistics
+  // counters. The counters are read without stopping concurrent
+  // operations, so they need not be consistent with each other.
+  CuckooMapStats stats() const {
+    CuckooMapStats s;
+    {
+      LockGuard guard(*this);
+      s.nrUsed = _nrUsed.load(std::memory_order_relaxed);
+      for (size_t layer = 0; layer < _tables.size(); ++layer) {
+        CuckooLayerStats l;
+        l.capacity = _tables[layer]->capacity();
+        l.nrUsed = _tables[layer]->nrUsed();
+        l.memoryUsage = _tables[layer]->memoryUsage();
+        l.lookupHits = _counters.layerHits[countedLayer(layer)].get();
+        s.memoryUsage += l.memoryUsage;
+        s.layers.push_back(l);
+      }
+    }
+    s.lookups = _counters.lookups.get();
+    s.lookupMisses = _counters.lookupMisses.get();
+    s.promotions = _counters.promotions.get();
+    s.inserts = _counters.inserts.get();
+    s.evictions = _counters.evictions.get();
+    s.maxEvictionChain = _counters.maxEvictionChain.get();
+    for (unsigned i = 0; i < CuckooMapStats::NrChainBuckets; ++i) {
+      s.evictionChains[i] = _counters.evictionChains[i].get();
+    }
+    s.newLayers = _counters.newLayers.get();
+    s.retiredLayers = _counters.retiredLayers.get();
+    s.rehashes = _counters.rehashes.get();
+    s.mutexWaits = _counters.mutexWaits.get();
+    s.mutexWaitNanos = _counters.mutexWaitNanos.get();
+    return s;
   }
 
  private:
-  void innerLookup(Key const& k, Finding& f) {
+  // The implementations of the lookups, visits and removes of the public
+  // interface, for Key and heterogeneous K alike:
+
+  // hash, if given, are the precomputed hashes of k.
+
+  template <class K>
+  Finding lookupAny(K const& k, CuckooHashPair const* hash = nullptr) {
+    LockGuard guard(*this);
+    Finding f(nullptr, nullptr, this, -1);
+    innerLookup(k, f, hash);
+    guard.release();
+    return f;
+  }
+
+  template <class K, class Visitor>
+  bool visitAny(K const& k, Visitor& visitor) {
+    SharedGuard guard(*this);
+    return withLockedPair(k, [&visitor](Layer&, Key*, Value* value) {
+      visitor(static_cast<Value const*>(value));
+    });
+  }
+
+  template <class K, class Updater>
+  bool updateAny(K const& k, Updater& updater) {
+    SharedGuard guard(*this);
+    return withLockedPair(
+        k, [&updater](Layer&, Key*, Value* value) { updater(value); });
+  }
+
+  // Inserts while the map is held shared, and rehashes the layers which
+  // the insert found flooded afterwards:
+  bool stripedInsert(Key k, Value const* v,
+                     CuckooHashPair const* hash = nullptr) {
+    bool inserted;
+    {
+      SharedGuard guard(*this);
+      StripeSet stripes;
+      inserted = innerInsert(k, v, nullptr, &stripes, hash);
+    }
+    rehashFloodedLayers();
+    return inserted;
+  }
+
+  template <class K>
+  bool removeAny(K const& k, CuckooHashPair const* hash = nullptr) {
+    bool emptiedLastLayer = false;
+    {
+      SharedGuard guard(*this);
+      if (!stripedRemove(k, emptiedLastLayer, hash)) {
+        return false;
+      }
+    }
+    if (emptiedLastLayer) {
+      LockGuard guard(*this);
+      retireEmptyLastLayer();
+    }
+    return true;
+  }
+
+  template <class K, class Reader>
+  bool lookupOptimisticAny(K const& k, Reader& reader,
+                           CuckooHashPair const* hash = nullptr) {
+    static_assert(std::is_trivially_copyable<Key>::value,
+                  "lock-free lookups need a trivially copyable Key");
+    EpochGuard epoch;
+    for (uint32_t attempt = 0; attempt < MaxOptimisticAttempts; ++attempt) {
+      uint64_t version = _version.load(std::memory_order_acquire);
+      if ((version & 1) != 0) {
+        continue;  // a writer holds the mutex
+      }
+      int found = findValidated(k, reader, hash);
+      if (found < 0) {
+        continue;  // a bucket was locked or changed
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (_version.load(std::memory_order_relaxed) == version) {
+        return found > 0;
+      }
+    }
+    LockGuard guard(*this);
+    Value* found = findInLayers(k);
+    if (found != nullptr) {
+      reader(found);
+    }
+    return found != nullptr;
+  }
+
+  // Inserts under the mutex, which f holds afterwards:
+  bool insertWithFinding(Key k, Value const* v, Finding& f) {
+    if (f._map != this) {
+      if (f._map != nullptr) {
+        f._map->release();
+      }
+      f._map = this;
+      lock();
+    }
+    bool res = innerInsert(k, v, nullptr, nullptr);
+    f._key = nullptr;
+    return res;
+  }
+
+  template <class K>
+  void prefetchAny(K const& k, CuckooHashPair const* hash) {
+    CuckooHashPair h = hashesOf(k, hash);
+    uint64_t pos1, pos2;
+    Layer& first = *_layers[0].load(std::memory_order_acquire);
+    buckets(first, h, pos1, pos2);
+    first.prefetchBuckets(pos1, pos2);
+    if (_nrLayers.load(std::memory_order_acquire) > 1) {
+      // Only the first layer is never retired:
+      EpochGuard epoch;
+      for (uint32_t layer = 1; layer < PrefetchLayers; ++layer) {
+        Layer* sub = _layers[layer].load(std::memory_order_acquire);
+        if (sub != nullptr) {
+          buckets(*sub, h, pos1, pos2);
+          sub->prefetchBuckets(pos1, pos2);
+        }
+      }
+    }
+  }
+
+  // The hashes of k for all layers, the precomputed ones if given. All
+  // layers hash alike, and the first one is never retired:
+  template <class K>
+  CuckooHashPair hashesOf(K const& k, CuckooHashPair const* hash) {
+    if (hash != nullptr) {
+      return *hash;
+    }
+    return _layers[0].load(std::memory_order_acquire)->hashes(k);
+  }
+
+  static void buckets(Layer& sub, CuckooHashPair const& hash, uint64_t& pos1,
+                      uint64_t& pos2) {
+    sub.bucketsByHash(hash.hash1, hash.hash2, pos1, pos2);
+  }
+
+  template <class K>
+  void innerLookup(K const& k, Finding& f,
+                   CuckooHashPair const* hash = nullptr) {
     char buffer[_valueSize];
     // f must be initialized with _key == nullptr
+    _counters.lookups.add(1);
+    CuckooHashPair h = hashesOf(k, hash);
     for (int32_t layer = 0; static_cast<uint32_t>(layer) < _tables.size();
          ++layer) {
-      Subtable& sub = *_tables[layer];
+      Layer& sub = *_tables[layer];
       Key* key;
       Value* value;
-      if (sub.lookup(k, key, value)) {
+      uint64_t pos1, pos2;
+      buckets(sub, h, pos1, pos2);
+      if (sub.lookupInBuckets(k, pos1, pos2, key, value)) {
         f._key = key;
         f._value = value;
         f._layer = layer;
-        if (layer != 0) {
-          Key kCopy = *key;
+        _counters.layerHits[countedLayer(layer)].add(1);
+        if (layer != 0 &&
+            _policy.promotion == CuckooMapPolicy::PromoteAlways) {
+          _counters.promotions.add(1);
+          CUCKOO_TRACE2(promote, this, layer);
+          Key kMoved = std::move(*key);
           memcpy(buffer, value, _valueSize);
           Value* vCopy = reinterpret_cast<Value*>(&buffer);
 
-          innerRemove(f);
-          innerInsert(kCopy, vCopy, &f);
+          sub.remove(key, value);
+          _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+          try {
+            // k hashes like the key found, which is not hashed again:
+            innerInsert(kMoved, vCopy, &f, nullptr, &h);
+          } catch (...) {
+            // The cascade cannot grow and is as it was, so the pair goes
+            // back to its buckets, where its slot is still free:
+            CuckooHashPair back = h;
+            sub.insertInBuckets(kMoved, vCopy, pos1, pos2, &f._key,
+                                &f._value, &back);
+            _nrUsed.fetch_add(1, std::memory_order_relaxed);
+            return;
+          }
+          if (static_cast<size_t>(layer) + 1 == _tables.size()) {
+            retireEmptyLastLayer();
+          }
         }
         return;
       };
     }
+    _counters.lookupMisses.add(1);
   }
 
-  bool innerInsert(Key const& k, Value const* v, Finding* f) {
+  bool innerInsert(Key& k, Value const* v, Finding* f, StripeSet* stripes,
+                   CuckooHashPair const* hash = nullptr) {
     // inserts a pair (k, v) into the table
     // returns true if the insertion took place and false if there was
     // already a pair with the same key k in the table, in which case
-    // the table is unchanged.
+    // the table is unchanged. With stripes, the caller only holds the map
+    // shared and the buckets are locked on the way, else the caller holds
+    // the mutex. k carries the pair which is currently on its way, keys
+    // are only moved. If f is given, it is pointed at the new pair. hash
+    // are the precomputed hashes of the new pair, if given. If no layer
+    // can be appended, the table is unchanged, k is the new key again and
+    // the exception is passed on.
 
-    Key kCopy = k;
-    Key originalKey = k;
     char buffer[_valueSize];
     memcpy(buffer, v, _valueSize);
     Value* vCopy = reinterpret_cast<Value*>(&buffer);
 
-    int32_t layer = 0;
-    int res;
-    while (static_cast<uint32_t>(layer) < _tables.size()) {
-      Subtable& sub = *_tables[layer];
+    // Until the new pair is in a slot, k carries it. Afterwards it can
+    // only be expunged again from that slot, whose buckets stay locked:
+    bool carryingNew = true;
+    Key* newKey = nullptr;
+    Value* newValue = nullptr;
+    uint32_t newLayer = 0;
+    auto arrived = [&](Key* kSlot, Value* vSlot, uint32_t layer, int res) {
+      if (carryingNew) {
+        carryingNew = false;
+        newKey = kSlot;
+        newValue = vSlot;
+        newLayer = layer;
+      } else if (res > 0 && kSlot == newKey) {
+        carryingNew = true;  // k now carries the new pair again
+      }
+    };
+    auto finish = [&]() {
+      if (f != nullptr) {
+        f->_key = newKey;
+        f->_value = newValue;
+        f->_layer = static_cast<int32_t>(newLayer);
+      }
+      _nrUsed.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    };
+
+    // The hashes of the pair k carries, which come along when a pair is
+    // expunged:
+    CuckooHashPair carried = hashesOf(k, hash);
+
+    uint32_t layer = 0;
+    int res = 1;
+    uint64_t chain = 0;  // number of pairs expunged so far
+    // The slots which expunged them, at most three per layer:
+    struct Expunged {
+      Layer* sub;
+      Key* key;
+      Value* value;
+    };
+    Expunged expunged[3 * MaxLayers];
+    // Layers which expunged a pair on their last try rather than being
+    // skipped because of busy bucket locks:
+    uint64_t overflowed = 0;
+    _counters.inserts.add(1);
+    while (true) {
+      if (layer == _nrLayers.load(std::memory_order_acquire)) {
+        // Some pair has been expunged from all layers, we have to append
+        // a new one, unless a concurrent insert just did:
+        std::unique_lock<std::mutex> growGuard(_growMutex, std::defer_lock);
+        if (stripes != nullptr) {
+          growGuard.lock();
+          if (layer < _nrLayers.load(std::memory_order_acquire)) {
+            continue;
+          }
+        }
+        flagFloodedLayers(layer, overflowed);
+        Key* kSlot;
+        Value* vSlot;
+        try {
+          appendNewLayer(k, vCopy, carried, layer, &kSlot, &vSlot);
+        } catch (...) {
+          // k may carry a pair of the map, so all expunged pairs go back
+          // in reverse order, their buckets are still locked:
+          while (chain > 0) {
+            --chain;
+            expunged[chain].sub->unexpunge(expunged[chain].key,
+                                           expunged[chain].value, k, vCopy,
+                                           &carried);
+          }
+          throw;
+        }
+        arrived(kSlot, vSlot, layer, 0);
+        countEvictions(chain);
+        return finish();
+      }
+      Layer& sub = *_layers[layer].load(std::memory_order_acquire);
       for (int i = 0; i < 3; ++i) {
-        if (f != nullptr && _compKey(originalKey, kCopy)) {
-          res = _tables[0]->insert(kCopy, vCopy, &(f->_key), &(f->_value));
-          f->_layer = layer;
-        } else {
-          res = sub.insert(kCopy, vCopy, nullptr, nullptr);
+        uint64_t pos1, pos2;
+        buckets(sub, carried, pos1, pos2);
+        if (stripes != nullptr &&
+            !stripes->lockBuckets(sub, layer, pos1, pos2)) {
+          break;  // out of lock order and busy, move the pair on
         }
+        Key* kSlot;
+        Value* vSlot;
+        res = sub.insertInBuckets(k, vCopy, pos1, pos2, &kSlot, &vSlot,
+                                  &carried);
         if (res < 0) {  // key is already in the table
+          countEvictions(chain);
           return false;
-        } else if (res == 0) {
-          ++_nrUsed;
-          return true;
+        }
+        arrived(kSlot, vSlot, layer, res);
+        if (res == 0) {
+          countEvictions(chain);
+          return finish();
+        }
+        expunged[chain] = Expunged{&sub, kSlot, vSlot};
+        ++chain;
+        CUCKOO_TRACE3(evict, this, layer, chain);
+        if (i == 2) {
+          overflowed |= uint64_t(1) << layer;
         }
       }
       ++layer;
     }
-    // If we get here, then some pair has been expunged from all tables and
-    // we have to append a new table:
-    uint64_t lastSize = _tables.back()->capacity();
-    auto t = new Subtable(lastSize * 4, _valueSize, _valueAlign);
+  }
+
+  // Puts the pair (k, *v) into a new last layer before it is published,
+  // so no bucket locks are needed. The caller holds the mutex or
+  // _growMutex. If this throws, the pair is still in k and *v.
+  void appendNewLayer(Key& k, Value* v, CuckooHashPair& hash, uint32_t layer,
+                      Key** kPtr, Value** vPtr) {
+    if (layer >= _policy.maxLayers) {
+      throw std::length_error("CuckooMap: too many layers");
+    }
+    uint64_t lastSize =
+        _layers[layer - 1].load(std::memory_order_acquire)->capacity();
+    auto t = new Layer(lastSize * _policy.growthFactor, _valueSize,
+                       _valueAlign, newSeed());
+    uint64_t pos1, pos2;
+    buckets(*t, hash, pos1, pos2);
+    int res = t->insertInBuckets(k, v, pos1, pos2, kPtr, vPtr, &hash);
+    (void)res;  // an empty layer has room for a single pair
+    appendLayer(t);
+    _counters.newLayers.add(1);
+    CUCKOO_TRACE3(new_layer, this, layer, t->capacity());
+  }
+
+  // Finds the pair with key k while the map is held shared, locking the
+  // buckets of k in one layer at a time, and calls fn(layer, key, value)
+  // with them locked. A pair only ever moves to later layers meanwhile,
+  // and the insert moving it holds the bucket it leaves until the pair
+  // has arrived, so the pair cannot be missed. Counted as a lookup.
+  template <class K, class Fn>
+  bool withLockedPair(K const& k, Fn fn,
+                      CuckooHashPair const* hash = nullptr) {
+    _counters.lookups.add(1);
+    CuckooHashPair h = hashesOf(k, hash);
+    for (uint32_t layer = 0;
+         layer < _nrLayers.load(std::memory_order_acquire); ++layer) {
+      Layer& sub = *_layers[layer].load(std::memory_order_acquire);
+      uint64_t pos1, pos2;
+      buckets(sub, h, pos1, pos2);
+      StripeSet stripes;
+      stripes.lockBuckets(sub, layer, pos1, pos2);
+      Key* key;
+      Value* value;
+      if (sub.lookupInBuckets(k, pos1, pos2, key, value)) {
+        _counters.layerHits[countedLayer(layer)].add(1);
+        fn(sub, key, value);
+        return true;
+      }
+    }
+    _counters.lookupMisses.add(1);
+    return false;
+  }
+
+  // Looks for k with its buckets in all layers locked and calls
+  // found(Value*) on its value, or else absent(Value*) on a zeroed buffer
+  // large and aligned enough for a Value, and inserts that. Returns
+  // whether it inserted.
+  template <class Found, class Absent>
+  bool findOrInsert(Key const& k, Found found, Absent absent) {
+    bool inserted = stripedFindOrInsert(k, found, absent);
+    if (inserted) {
+      rehashFloodedLayers();
+    }
+    return inserted;
+  }
+
+  template <class Found, class Absent>
+  bool stripedFindOrInsert(Key const& k, Found& found, Absent& absent) {
+    SharedGuard guard(*this);
+    StripeSet stripes;
+    _counters.lookups.add(1);
+    CuckooHashPair h = hashesOf(k, nullptr);
+    for (uint32_t layer = 0;
+         layer < _nrLayers.load(std::memory_order_acquire); ++layer) {
+      Layer& sub = *_layers[layer].load(std::memory_order_acquire);
+      uint64_t pos1, pos2;
+      buckets(sub, h, pos1, pos2);
+      stripes.lockBuckets(sub, layer, pos1, pos2);
+      Key* key;
+      Value* value;
+      if (sub.lookupInBuckets(k, pos1, pos2, key, value)) {
+        _counters.layerHits[countedLayer(layer)].add(1);
+        found(value);
+        return false;
+      }
+    }
+    _counters.lookupMisses.add(1);
+    size_t size = _valueSize > sizeof(Value) ? _valueSize : sizeof(Value);
+    char buffer[size + alignof(Value)];
+    Value* fresh = reinterpret_cast<Value*>(
+        (reinterpret_cast<uintptr_t>(buffer) + alignof(Value) - 1) &
+        ~static_cast<uintptr_t>(alignof(Value) - 1));
+    std::memset(static_cast<void*>(fresh), 0, size);
+    absent(fresh);
+    // The buckets of k are still locked, so k is not found on the way:
+    Key kCopy(k);
+    innerInsert(kCopy, fresh, nullptr, &stripes, &h);
+    return true;
+  }
+
+  // Removes the pair with key k while the map is held shared. Sets
+  // emptiedLastLayer if the pair was the last one in the last layer.
+  template <class K>
+  bool stripedRemove(K const& k, bool& emptiedLastLayer,
+                     CuckooHashPair const* hash = nullptr) {
+    return withLockedPair(
+        k,
+        [this, &emptiedLastLayer](Layer& sub, Key* key, Value* value) {
+          sub.remove(key, value);
+          _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+          uint32_t n = _nrLayers.load(std::memory_order_acquire);
+          emptiedLastLayer =
+              &sub == _layers[n - 1].load(std::memory_order_acquire) &&
+              sub.nrUsed() == 0;
+        },
+        hash);
+  }
+
+  static size_t countedLayer(size_t layer) {
+    return layer < MaxCountedLayers ? layer : MaxCountedLayers - 1;
+  }
+
+  void countEvictions(uint64_t chain) {
+    _counters.evictions.add(chain);
+    _counters.maxEvictionChain.max(chain);
+    _counters.evictionChains[CuckooMapStats::chainBucket(chain)].add(1);
+  }
+
+  // Takes ownership of t and publishes it to lock-free readers and
+  // striped writers:
+  void appendLayer(Layer* t) {
     try {
       _tables.emplace_back(t);
     } catch (...) {
       delete t;
       throw;
     }
-    while (res > 0) {
-      if (f != nullptr && _compKey(originalKey, kCopy)) {
-        res = _tables.back()->insert(kCopy, vCopy, &(f->_key), &(f->_value));
-        f->_layer = layer;
-      } else {
-        res = _tables.back()->insert(kCopy, vCopy, nullptr, nullptr);
+    _layers[_tables.size() - 1].store(t, std::memory_order_release);
+    _nrLayers.store(static_cast<uint32_t>(_tables.size()),
+                    std::memory_order_release);
+  }
+
+  uint64_t newSeed() const {
+    return _policy.randomSeeds || _seedNewLayers.load(std::memory_order_relaxed)
+               ? cuckooRandomSeed()
+               : 0;
+  }
+
+  // A pair which has to go to a new layer has been passed on by all
+  // nrLayers layers, by those in overflowed because their buckets were
+  // full. If one of these but the last was mostly empty nevertheless, keys
+  // collide far more than the hashes should let them (see
+  // CuckooMapPolicy::rehashBelowLoad). The mostly empty ones are then
+  // flagged for rehashing, and new layers get random seeds from now on,
+  // starting with the one about to be appended:
+  void flagFloodedLayers(uint32_t nrLayers, uint64_t overflowed) {
+    uint64_t flooded = 0;
+    for (uint32_t layer = 0; layer < nrLayers; ++layer) {
+      Layer& sub = *_layers[layer].load(std::memory_order_acquire);
+      if (((overflowed >> layer) & 1) != 0 &&
+          sub.nrUsed() < sub.capacity() * _policy.rehashBelowLoad) {
+        flooded |= uint64_t(1) << layer;
       }
     }
-    ++_nrUsed;
-    return true;
+    // The last layer alone is often still sparse when it overflows:
+    if ((flooded & ((uint64_t(1) << (nrLayers - 1)) - 1)) == 0) {
+      return;
+    }
+    _seedNewLayers.store(true, std::memory_order_relaxed);
+    _flooded.fetch_or(flooded, std::memory_order_relaxed);
   }
 
-  void release() { _mutex.unlock(); }
+  // Rehashes the flagged layers under the mutex, so that lock-free
+  // readers retry meanwhile. Called without holding the map.
+  void rehashFloodedLayers() {
+    if (_flooded.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    LockGuard guard(*this);
+    uint64_t flooded = _flooded.exchange(0, std::memory_order_relaxed);
+    for (uint32_t layer = 0; layer < _tables.size(); ++layer) {
+      if ((flooded >> layer) & 1) {
+        rehashLayer(layer);
+      }
+    }
+  }
+
+  // Gives a layer a new random seed in place, it stays where it is for
+  // striped writers and readers. If its pairs do not all fit under any of
+  // a few seeds, they collide whatever the seed and the layer is left as
+  // it is. The caller holds the mutex.
+  void rehashLayer(uint32_t layer) {
+    for (uint32_t tries = 1; tries <= MaxReseeds; ++tries) {
+      if (_tables[layer]->reseed(cuckooRandomSeed())) {
+        _counters.rehashes.add(1);
+        CUCKOO_TRACE3(rehash_layer, this, layer, tries);
+        return;
+      }
+    }
+  }
+
+  // Drops the last layer once it is empty and the one before it is at
+  // most half full again. Lock-free readers may still be looking at it, so
+  // it is freed by epoch-based reclamation.
+  void retireEmptyLastLayer() {
+    size_t n = _tables.size();
+    if (n < 2 || _tables[n - 1]->nrUsed() != 0 ||
+        _tables[n - 2]->nrUsed() * 2 > _tables[n - 2]->capacity()) {
+      return;
+    }
+    _nrLayers.store(static_cast<uint32_t>(n - 1), std::memory_order_release);
+    _layers[n - 1].store(nullptr, std::memory_order_release);
+    Layer* t = _tables.back().release();
+    _tables.pop_back();
+    _counters.retiredLayers.add(1);
+    CUCKOO_TRACE2(retire_layer, this, n - 1);
+    EpochManager::instance().retire(t);
+  }
+
+  // Looks for k in all layers, the caller must hold the mutex:
+  template <class K>
+  Value* findInLayers(K const& k) {
+    for (auto const& t : _tables) {
+      Key* key;
+      Value* value;
+      if (t->lookup(k, key, value)) {
+        return value;
+      }
+    }
+    return nullptr;
+  }
+
+  // Looks for k in all layers without any lock and calls reader on the
+  // value if found. Returns 1 if found, 0 if not and -1 if a bucket of k
+  // was locked or changed meanwhile. The caller must be in an EpochGuard
+  // and validate the map version.
+  template <class K, class Reader>
+  int findValidated(K const& k, Reader& reader,
+                    CuckooHashPair const* hash = nullptr) {
+    CuckooHashPair h = hashesOf(k, hash);
+    uint32_t n = _nrLayers.load(std::memory_order_acquire);
+    for (uint32_t layer = 0; layer < n; ++layer) {
+      Layer* t = _layers[layer].load(std::memory_order_acquire);
+      if (t == nullptr) {
+        return -1;  // retired meanwhile
+      }
+      uint64_t pos1, pos2;
+      buckets(*t, h, pos1, pos2);
+      int found = findValidatedInBuckets(*t, k, pos1, pos2, reader);
+      if (found != 0) {
+        return found;
+      }
+    }
+    // A pair moved on into a layer appended after we looked:
+    return _nrLayers.load(std::memory_order_acquire) == n ? 0 : -1;
+  }
+
+  // The same for the buckets pos1 and pos2 of k in a single layer:
+  template <class K, class Reader>
+  static int findValidatedInBuckets(Layer& t, K const& k, uint64_t pos1,
+                                    uint64_t pos2, Reader& reader) {
+    std::atomic<uint64_t>& s1 = t.stripe(pos1);
+    std::atomic<uint64_t>& s2 = t.stripe(pos2);
+    uint64_t v1 = s1.load(std::memory_order_acquire);
+    uint64_t v2 = s2.load(std::memory_order_acquire);
+    if (((v1 | v2) & 1) != 0) {
+      return -1;
+    }
+    Key* key;
+    Value* value;
+    bool hit = t.lookupInBuckets(k, pos1, pos2, key, value);
+    if (hit) {
+      reader(static_cast<Value const*>(value));
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s1.load(std::memory_order_relaxed) != v1 ||
+        s2.load(std::memory_order_relaxed) != v2) {
+      return -1;
+    }
+    return hit ? 1 : 0;
+  }
+
+  // The bucket locks held by one insert or remove, all released at the
+  // end. Locks are ordered by layer and then by stripe index. A lock
+  // which is not above all locks held is only tried, so the order is
+  // never violated while waiting.
+  class StripeSet {
+    static constexpr uint32_t MaxHeld = 4 * MaxLayers;
+
+    std::atomic<uint64_t>* _held[MaxHeld];
+    uint32_t _nrHeld;
+    int64_t _topLayer;            // highest layer with a lock held
+    std::atomic<uint64_t>* _top;  // highest lock held in _topLayer
+
+   public:
+    StripeSet() : _nrHeld(0), _topLayer(-1), _top(nullptr) {}
+
+    ~StripeSet() {
+      for (uint32_t i = 0; i < _nrHeld; ++i) {
+        _held[i]->store(_held[i]->load(std::memory_order_relaxed) + 1,
+                        std::memory_order_release);
+      }
+    }
+
+    StripeSet(StripeSet const&) = delete;
+    StripeSet& operator=(StripeSet const&) = delete;
+
+    // Locks the stripes of buckets pos1 and pos2 of the layer with index
+    // layerIndex, returns false if one of them was out of order and busy.
+    bool lockBuckets(Layer& layer, uint32_t layerIndex, uint64_t pos1,
+                     uint64_t pos2) {
+      if (static_cast<int64_t>(layerIndex) > _topLayer) {
+        _topLayer = layerIndex;
+        _top = nullptr;
+      }
+      bool inOrder = static_cast<int64_t>(layerIndex) == _topLayer;
+      std::atomic<uint64_t>* a = &layer.stripe(pos1);
+      std::atomic<uint64_t>* b = &layer.stripe(pos2);
+      if (b < a) {
+        std::swap(a, b);
+      }
+      return lockStripe(a, inOrder) && lockStripe(b, inOrder);
+    }
+
+   private:
+    bool lockStripe(std::atomic<uint64_t>* s, bool inOrder) {
+      for (uint32_t i = 0; i < _nrHeld; ++i) {
+        if (_held[i] == s) {
+          return true;
+        }
+      }
+      if (_nrHeld == MaxHeld) {
+        return false;
+      }
+      bool mayWait = inOrder && (_top == nullptr || s > _top);
+      uint32_t spins = 0;
+      while (true) {
+        uint64_t v = s->load(std::memory_order_relaxed);
+        if ((v & 1) == 0 &&
+            s->compare_exchange_weak(v, v + 1, std::memory_order_acquire,
+                                     std::memory_order_relaxed)) {
+          break;
+        }
+        if (!mayWait) {
+          return false;
+        }
+        if (++spins % 64 == 0) {
+          std::this_thread::yield();
+        }
+      }
+      _held[_nrHeld++] = s;
+      if (mayWait) {
+        _top = s;
+      }
+      return true;
+    }
+  };
+
+  // Holds the map shared for inserts and removes without a Finding, they
+  // exclude the mutex (and thus Findings) but not each other:
+  class SharedGuard {
+    CuckooMap const& _map;
+
+   public:
+    explicit SharedGuard(CuckooMap const& map) : _map(map) {
+      while (true) {
+        _map._sharedWriters.fetch_add(1, std::memory_order_seq_cst);
+        if (!_map._exclusive.load(std::memory_order_seq_cst)) {
+          return;
+        }
+        _map._sharedWriters.fetch_sub(1, std::memory_order_seq_cst);
+        std::lock_guard<std::mutex> wait(_map._mutex);
+      }
+    }
+
+    ~SharedGuard() {
+      _map._sharedWriters.fetch_sub(1, std::memory_order_release);
+    }
+  };
+
+  // Takes the mutex and waits for running inserts and removes without a
+  // Finding to finish, new ones wait for the mutex:
+  void lock() const {
+    uint64_t waitNanos = 0;
+#if CUCKOO_MAP_STATISTICS
+    if (!_mutex.try_lock()) {
+      auto start = std::chrono::steady_clock::now();
+      _mutex.lock();
+      _exclusive.store(true, std::memory_order_seq_cst);
+      waitForSharedWriters();
+      waitNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+      _counters.mutexWaits.add(1);
+      _counters.mutexWaitNanos.add(waitNanos);
+    } else {
+      _exclusive.store(true, std::memory_order_seq_cst);
+      waitForSharedWriters();
+    }
+#else
+    _mutex.lock();
+    _exclusive.store(true, std::memory_order_seq_cst);
+    waitForSharedWriters();
+#endif
+    CUCKOO_TRACE2(lock_acquire, this, waitNanos);
+    (void)waitNanos;
+    // Odd while the mutex is held, lock-free readers validate against it:
+    _version.store(_version.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void release() const {
+    CUCKOO_TRACE1(lock_release, this);
+    _version.store(_version.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+    _exclusive.store(false, std::memory_order_release);
+    _mutex.unlock();
+  }
+
+  void waitForSharedWriters() const {
+    uint32_t spins = 0;
+    while (_sharedWriters.load(std::memory_order_seq_cst) != 0) {
+      if (++spins % 64 == 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // Holds the mutex for a scope, like MyMutexGuard, but through lock()
+  // and release(), so that waits are counted and traced:
+  class LockGuard {
+    CuckooMap const& _map;
+    bool _locked;
+
+   public:
+    explicit LockGuard(CuckooMap const& map) : _map(map), _locked(true) {
+      _map.lock();
+    }
+
+    ~LockGuard() {
+      if (_locked) {
+        _map.release();
+      }
+    }
+
+    // Gives up ownership without unlocking, the caller is responsible:
+    void release() { _locked = false; }
+  };
 
   void innerRemove(Finding& f) {
     _tables[f._layer]->remove(f._key, f._value);
     f._key = nullptr;
-    --_nrUsed;
+    _nrUsed.fetch_sub(1, std::memory_order_relaxed);
+    if (static_cast<size_t>(f._layer) + 1 == _tables.size()) {
+      retireEmptyLastLayer();
+    }
   }
 
-  std::vector<std::unique_ptr<Subtable>> _tables;
-  std::mutex _mutex;
-  uint64_t _nrUsed;
+  // Owns the layers. Appended to under the mutex, or by striped inserts
+  // under _growMutex while the map is held shared, and popped only under
+  // the mutex. Only these and holders of the mutex read it, everything
+  // else which may run while the map is held shared reads _layers and
+  // _nrLayers instead:
+  std::vector<std::unique_ptr<Layer>> _tables;
+  // The same layers for lock-free readers and striped writers:
+  std::atomic<Layer*> _layers[MaxLayers];
+  mutable std::atomic<uint64_t> _version;
+  std::atomic<uint32_t> _nrLayers;
+  mutable std::mutex _mutex;
+  mutable std::atomic<bool> _exclusive;          // the mutex is held
+  mutable std::atomic<uint32_t> _sharedWriters;  // in a SharedGuard
+  std::mutex _growMutex;  // striped writers appending a layer
+  std::atomic<uint64_t> _nrUsed;
+  std::atomic<uint64_t> _flooded;  // layers to rehash, bit i for layer i
+  std::atomic<bool> _seedNewLayers;  // a flood was seen, see newSeed()
+
+  // Lookup hits of all layers beyond the last one are counted there:
+  static constexpr uint32_t MaxCountedLayers = 32;
+
+  struct Counters {
+    StatisticsCounter lookups;
+    StatisticsCounter lookupMisses;
+    StatisticsCounter promotions;
+    // including re-inserts of promoted pairs:
+    StatisticsCounter inserts;
+    StatisticsCounter evictions;
+    StatisticsCounter maxEvictionChain;
+    StatisticsCounter evictionChains[CuckooMapStats::NrChainBuckets];
+    StatisticsCounter newLayers;
+    StatisticsCounter retiredLayers;
+    StatisticsCounter rehashes;
+    StatisticsCounter mutexWaits;
+    StatisticsCounter mutexWaitNanos;
+    StatisticsCounter layerHits[MaxCountedLayers];
+  };
+  mutable Counters _counters;
 };
 
 #endif
@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <cstring>
 #include <memory>
+#include <type_traits>
+#include <utility>
 
 #include "CuckooMap.h"
 
@@ -34,6 +36,7 @@ class CuckooMultiMap {
     int32_t seq;
     InnerKey() : Key(), seq(0) {}
     InnerKey(Key const& other, int32_t s) : Key(other), seq(s) {}
+    InnerKey(Key&& other, int32_t s) : Key(std::move(other)), seq(s) {}
     bool empty() { return seq == 0; }
   };
 
@@ -67,7 +70,12 @@ class CuckooMultiMap {
     }
   };
 
-  typedef CuckooMap<InnerKey, Value, InnerHashKey1, InnerHashKey2, InnerCompKey>
+  // SingleHash stays SingleHash for the inner map:
+  typedef typename std::conditional<IsSingleHash<HashKey2>::value, SingleHash,
+                                    InnerHashKey2>::type InnerHashKey2Type;
+
+  typedef CuckooMap<InnerKey, Value, InnerHashKey1, InnerHashKey2Type,
+                    InnerCompKey>
       InnerCuckooMap;
 
   InnerCuckooMap _innerMap;
@@ -79,10 +87,13 @@ class CuckooMultiMap {
   typedef HashKey1 HashKey1Type;
   typedef HashKey2 HashKey2Type;
   typedef CompKey CompKeyType;
+  typedef CuckooMapPolicy PolicyType;
 
   CuckooMultiMap(size_t firstSize, size_t valueSize = sizeof(Value),
-                 size_t valueAlign = alignof(Value))
-      : _innerMap(firstSize, valueSize, valueAlign), _valueSize(valueSize) {}
+                 size_t valueAlign = alignof(Value),
+                 CuckooMapPolicy const& policy = CuckooMapPolicy())
+      : _innerMap(firstSize, valueSize, valueAlign, policy),
+        _valueSize(valueSize) {}
 
   // Destruction, copying and moving exactly as CuckooMap
 
@@ -108,6 +119,12 @@ class CuckooMultiMap {
           _innerFinding(m->_innerMap.lookup(_innerKey)),
           _count(_innerFinding.found() == 0 ? 0 : -_innerFinding.key()->seq) {}
 
+    Finding(Key&& k, CuckooMultiMap* m)
+        : _map(m),
+          _innerKey(std::move(k), 0),
+          _innerFinding(m->_innerMap.lookup(_innerKey)),
+          _count(_innerFinding.found() == 0 ? 0 : -_innerFinding.key()->seq) {}
+
     // This class is automatically movable (because InnerKey and _innerFinding
     // are, and not copyable, because _innerFinding is not. Destruction
     // destructs _innerFinding and thus releases the mutex.
@@ -183,7 +200,13 @@ class CuckooMultiMap {
     // returns true if the insertion took place and false if there was
     // already a pair with the same key k in the table.
     Finding f(k, this);
-    return innerInsert(f, v);
+    return innerInsert(f, v, true);
+  }
+
+  // As above, but k is moved into the map instead of copied:
+  bool insert(Key&& k, Value const* v) {
+    Finding f(std::move(k), this);
+    return innerInsert(f, v, true);
   }
 
   bool insert(Key const& k, Value const* v, Finding& f) {
@@ -193,6 +216,84 @@ class CuckooMultiMap {
     return innerInsert(f, v);
   }
 
+  // Calls visitor(Value const*) on the value of every pair with key k and
+  // returns whether there is any. The map stays locked meanwhile, visitor
+  // must not use it.
+  template <class Visitor>
+  bool visit(Key const& k, Visitor visitor) {
+    Finding f(k, this);
+    if (f.found() == 0) {
+      return false;
+    }
+    do {
+      visitor(static_cast<Value const*>(f.value()));
+    } while (f.next());
+    return true;
+  }
+
+  // As visit, but updater(Value*) may change the values in place:
+  template <class Updater>
+  bool update(Key const& k, Updater updater) {
+    Finding f(k, this);
+    if (f.found() == 0) {
+      return false;
+    }
+    do {
+      updater(f.value());
+    } while (f.next());
+    return true;
+  }
+
+  // The read-modify-write operations of CuckooMap, with a single lookup
+  // under the mutex. Where CuckooMap changes the value of the pair with
+  // key k, these change the values of all pairs with key k.
+
+  bool insertOrAssign(Key const& k, Value const* v) {
+    Finding f(k, this);
+    if (f.found() == 0) {
+      return innerInsert(f, v);
+    }
+    do {
+      std::memcpy(f.value(), v, _valueSize);
+    } while (f.next());
+    return false;
+  }
+
+  template <class... Args>
+  bool tryEmplace(Key const& k, Args&&... args) {
+    return computeIfAbsent(k, [&](Value* fresh) {
+      new (fresh) Value(std::forward<Args>(args)...);
+    });
+  }
+
+  template <class Factory>
+  bool computeIfAbsent(Key const& k, Factory factory) {
+    Finding f(k, this);
+    if (f.found() != 0) {
+      return false;
+    }
+    size_t size = _valueSize > sizeof(Value) ? _valueSize : sizeof(Value);
+    char buffer[size + alignof(Value)];
+    Value* fresh = reinterpret_cast<Value*>(
+        (reinterpret_cast<uintptr_t>(buffer) + alignof(Value) - 1) &
+        ~static_cast<uintptr_t>(alignof(Value) - 1));
+    std::memset(static_cast<void*>(fresh), 0, size);
+    factory(fresh);
+    return innerInsert(f, fresh);
+  }
+
+  template <class Merge>
+  bool upsert(Key const& k, Value const* v, Merge merge) {
+    Finding f(k, this);
+    if (f.found() == 0) {
+      return innerInsert(f, v);
+    }
+    do {
+      merge(f.value(), v);
+    } while (f.next());
+    return false;
+  }
+
   bool remove(Key const& k) {
     Finding f(k, this);
     if (f._count == 0) {
@@ -230,18 +331,30 @@ class CuckooMultiMap {
 
   uint64_t nrUsed() { return _innerMap.nrUsed(); }
 
+  uint64_t memoryUsage() const {
+    return sizeof(CuckooMultiMap) - sizeof(InnerCuckooMap) +
+           _innerMap.memoryUsage();
+  }
+
+  // Statistics of the underlying CuckooMap, every pair counts separately:
+  CuckooMapStats stats() const { return _innerMap.stats(); }
+
  private:
-  bool innerInsert(Finding& f, Value const* v) {
-    // f must just have been used to look for f._innerKey
+  // f must just have been used to look for f._innerKey. If f is a
+  // temporary, its key is moved into the map instead of copied.
+  bool innerInsert(Finding& f, Value const* v, bool temporary = false) {
     if (f.found() == 0) {
       // First with this key, and we now hold the mutex
       f._innerKey.seq = -1;
+    } else {
+      // There are already nr pairs with key k:
+      f._innerKey.seq = -(f._innerFinding.key()->seq--);
+    }
+    if (temporary) {
+      _innerMap.insert(std::move(f._innerKey), v, f._innerFinding);
+    } else {
       _innerMap.insert(f._innerKey, v, f._innerFinding);
-      return true;
     }
-    // There are already nr pairs with key k:
-    f._innerKey.seq = -(f._innerFinding.key()->seq--);
-    _innerMap.insert(f._innerKey, v, f._innerFinding);
     return true;
   }
 };
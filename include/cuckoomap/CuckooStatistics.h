@@ -0,0 +1,175 @@
+#ifndef CUCKOO_STATISTICS_H
+#define CUCKOO_STATISTICS_H 1
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Statistics counters are compiled in by default. Compile with
+// -DCUCKOO_MAP_STATISTICS=0 to remove them entirely, stats() then only
+// reports the sizes of the layers.
+#ifndef CUCKOO_MAP_STATISTICS
+#define CUCKOO_MAP_STATISTICS 1
+#endif
+
+#if CUCKOO_MAP_STATISTICS
+
+// A counter which may be incremented concurrently. Increments are relaxed
+// atomic operations, so a snapshot of several counters is not necessarily
+// consistent, but no increment is lost. Padded so that neighbouring
+// counters, which different threads increment, never share a cache line,
+// also without alignment guarantees from operator new.
+class StatisticsCounter {
+  std::atomic<uint64_t> _value;
+  char _padding[64 - sizeof(std::atomic<uint64_t>)];
+
+ public:
+  StatisticsCounter() : _value(0) {}
+
+  void add(uint64_t n) { _value.fetch_add(n, std::memory_order_relaxed); }
+
+  void max(uint64_t n) {
+    uint64_t old = _value.load(std::memory_order_relaxed);
+    while (n > old && !_value.compare_exchange_weak(
+                          old, n, std::memory_order_relaxed)) {
+    }
+  }
+
+  uint64_t get() const { return _value.load(std::memory_order_relaxed); }
+};
+
+#else
+
+// Counts nothing and takes no space in the counters of a map:
+class StatisticsCounter {
+ public:
+  void add(uint64_t) {}
+  void max(uint64_t) {}
+  uint64_t get() const { return 0; }
+};
+
+#endif
+
+struct CuckooLayerStats {
+  uint64_t capacity;     // number of slots
+  uint64_t nrUsed;       // number of occupied slots
+  uint64_t memoryUsage;  // bytes
+  uint64_t lookupHits;   // lookups which found their key in this layer
+};
+
+struct CuckooMapStats {
+  // Number of buckets of the eviction chain length histogram, bucket i
+  // counts inserts with a chain length in [2^(i-1), 2^i), bucket 0 those
+  // without any eviction:
+  static constexpr unsigned NrChainBuckets = 16;
+
+  std::vector<CuckooLayerStats> layers;
+  uint64_t nrUsed;
+  uint64_t memoryUsage;
+  uint64_t lookups;
+  uint64_t lookupMisses;
+  uint64_t promotions;  // pairs moved to the first layer by a lookup
+  uint64_t inserts;
+  uint64_t evictions;  // total number of pairs expunged during inserts
+  uint64_t maxEvictionChain;
+  uint64_t evictionChains[NrChainBuckets];
+  uint64_t newLayers;      // number of layers appended
+  uint64_t retiredLayers;  // number of empty last layers dropped
+  uint64_t rehashes;       // layers rehashed with a new seed
+  uint64_t mutexWaits;      // lock acquisitions which had to block
+  uint64_t mutexWaitNanos;  // total time spent blocking on the mutex
+
+  CuckooMapStats()
+      : nrUsed(0),
+        memoryUsage(0),
+        lookups(0),
+        lookupMisses(0),
+        promotions(0),
+        inserts(0),
+        evictions(0),
+        maxEvictionChain(0),
+        newLayers(0),
+        retiredLayers(0),
+        rehashes(0),
+        mutexWaits(0),
+        mutexWaitNanos(0) {
+    for (unsigned i = 0; i < NrChainBuckets; ++i) {
+      evictionChains[i] = 0;
+    }
+  }
+
+  static unsigned chainBucket(uint64_t length) {
+    unsigned bucket = 0;
+    while (length > 0 && bucket < NrChainBuckets - 1) {
+      length >>= 1;
+      ++bucket;
+    }
+    return bucket;
+  }
+
+  // Adds the counters of other to this, layers are added position-wise:
+  void merge(CuckooMapStats const& other) {
+    if (layers.size() < other.layers.size()) {
+      layers.resize(other.layers.size(), CuckooLayerStats{0, 0, 0, 0});
+    }
+    for (size_t i = 0; i < other.layers.size(); ++i) {
+      layers[i].capacity += other.layers[i].capacity;
+      layers[i].nrUsed += other.layers[i].nrUsed;
+      layers[i].memoryUsage += other.layers[i].memoryUsage;
+      layers[i].lookupHits += other.layers[i].lookupHits;
+    }
+    nrUsed += other.nrUsed;
+    memoryUsage += other.memoryUsage;
+    lookups += other.lookups;
+    lookupMisses += other.lookupMisses;
+    promotions += other.promotions;
+    inserts += other.inserts;
+    evictions += other.evictions;
+    if (other.maxEvictionChain > maxEvictionChain) {
+      maxEvictionChain = other.maxEvictionChain;
+    }
+    for (unsigned i = 0; i < NrChainBuckets; ++i) {
+      evictionChains[i] += other.evictionChains[i];
+    }
+    newLayers += other.newLayers;
+    retiredLayers += other.retiredLayers;
+    rehashes += other.rehashes;
+    mutexWaits += other.mutexWaits;
+    mutexWaitNanos += other.mutexWaitNanos;
+  }
+};
+
+struct ShardStats {
+  uint64_t lookups;
+  uint64_t inserts;
+  uint64_t removes;
+  CuckooMapStats map;
+};
+
+struct ShardedMapStats {
+  std::vector<ShardStats> shards;
+  CuckooMapStats total;  // merged over all shards
+};
+
+inline std::ostream& operator<<(std::ostream& out, CuckooMapStats const& s) {
+  out << "pairs: " << s.nrUsed << ", memory: " << s.memoryUsage
+      << " bytes, lookups: " << s.lookups << " (misses: " << s.lookupMisses
+      << ", promotions: " << s.promotions << "), inserts: " << s.inserts
+      << " (evictions: " << s.evictions
+      << ", longest chain: " << s.maxEvictionChain
+      << "), new layers: " << s.newLayers
+      << ", retired layers: " << s.retiredLayers
+      << ", rehashes: " << s.rehashes
+      << ", mutex waits: " << s.mutexWaits
+      << " (" << s.mutexWaitNanos << " ns)\n";
+  for (size_t i = 0; i < s.layers.size(); ++i) {
+    CuckooLayerStats const& l = s.layers[i];
+    out << "  layer " << i << ": " << l.nrUsed << "/" << l.capacity
+        << " slots, " << l.memoryUsage << " bytes, " << l.lookupHits
+        << " lookup hits\n";
+  }
+  return out;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CUCKOO_TRACING_H
+#define CUCKOO_TRACING_H 1
+
+// Static tracepoints (USDT probes, provider "cuckoomap") on the events of
+// the cascade, for example for bpftrace:
+//
+//   bpftrace -e 'usdt:./binary:cuckoomap:new_layer { printf("%d\n", arg2); }'
+//
+// An inactive USDT probe is a single nop, so the probes are compiled in
+// whenever <sys/sdt.h> (systemtap-sdt-dev) is available. Compile with
+// -DCUCKOO_MAP_TRACING=0 to remove them entirely. The probes are:
+//
+//   kick(table, bucket, slot)          InternalCuckooMap::insert expunges
+//                                      the pair in a slot
+//   evict(map, layer, chain)           CuckooMap::innerInsert moves an
+//                                      expunged pair on, chain counts the
+//                                      pairs expunged by this insert so far
+//   new_layer(map, layer, capacity)    a layer is appended
+//   retire_layer(map, layer)           an empty last layer is dropped
+//   rehash_layer(map, layer, tries)    a flooded layer is rehashed with a
+//                                      new seed, the tries-th random one
+//                                      under which all its pairs fit
+//   promote(map, layer)                a lookup hit moves its pair from
+//                                      layer to the first layer
+//   lock_acquire(map, waitNanos)       the mutex of a map is taken,
+//                                      waitNanos is only measured with
+//                                      CUCKOO_MAP_STATISTICS, else 0
+//   lock_release(map)                  the mutex is given up, for a
+//                                      lookup that is when its Finding
+//                                      dies
+
+#ifndef CUCKOO_MAP_TRACING
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define CUCKOO_MAP_TRACING 1
+#endif
+#endif
+#endif
+
+#ifndef CUCKOO_MAP_TRACING
+#define CUCKOO_MAP_TRACING 0
+#endif
+
+#if CUCKOO_MAP_TRACING
+
+#include <sys/sdt.h>
+
+#define CUCKOO_TRACE1(name, a) DTRACE_PROBE1(cuckoomap, name, a)
+#define CUCKOO_TRACE2(name, a, b) DTRACE_PROBE2(cuckoomap, name, a, b)
+#define CUCKOO_TRACE3(name, a, b, c) DTRACE_PROBE3(cuckoomap, name, a, b, c)
+
+#else
+
+#define CUCKOO_TRACE1(name, a) \
+  do {                         \
+  } while (0)
+#define CUCKOO_TRACE2(name, a, b) \
+  do {                            \
+  } while (0)
+#define CUCKOO_TRACE3(name, a, b, c) \
+  do {                               \
+  } while (0)
+
+#endif
+
+#endif
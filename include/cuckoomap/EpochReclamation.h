@@ -0,0 +1,221 @@
+#ifndef EPOCH_RECLAMATION_H
+#define EPOCH_RECLAMATION_H 1
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Epoch-based reclamation: memory that lock-free readers may still be
+// looking at is not freed immediately but retired, and freed once every
+// thread has left the critical sections (EpochGuard scopes) it might have
+// been in at the time of retirement.
+//
+// There is a global epoch. A reader announces the epoch it entered in, in
+// its own thread record. The global epoch only advances when all readers
+// inside a critical section have announced the current one, so memory
+// retired in epoch e can no longer be reached by anybody once the global
+// epoch has reached e + 2. Entering and leaving a critical section only
+// writes the thread's own record, so readers do not contend. Retiring and
+// freeing take a mutex and are meant to be rare (for example dropping a
+// whole layer of a CuckooMap). There is one process-wide EpochManager.
+//
+// Usage:
+//   {
+//     EpochGuard guard;  // pointers read from now on stay valid
+//     ... read shared structures ...
+//   }
+//   // writer, after unlinking p:
+//   EpochManager::instance().retire(p);
+
+class EpochManager {
+  // Padded so that the announcements of different threads never share a
+  // cache line, also without alignment guarantees from operator new:
+  struct Record {
+    std::atomic<uint64_t> epoch;  // 0 if not in a critical section
+    std::atomic<bool> inUse;      // owned by a thread
+    uint32_t nesting;             // only touched by the owning thread
+    Record* next;
+    char padding[128];
+
+    Record() : epoch(0), inUse(true), nesting(0), next(nullptr) {}
+  };
+
+  struct Retired {
+    void* object;
+    void (*deleter)(void*);
+    uint64_t epoch;
+  };
+
+  // Gives the record of a thread back when the thread ends:
+  struct ThreadHandle {
+    Record* record;
+
+    ThreadHandle() : record(nullptr) {}
+    ~ThreadHandle() {
+      if (record != nullptr) {
+        record->inUse.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  EpochManager() : _epoch(1), _records(nullptr) {}
+
+ public:
+  ~EpochManager() {
+    // No readers are left, everything can go:
+    for (Retired const& r : _retired) {
+      r.deleter(r.object);
+    }
+    Record* rec = _records.load();
+    while (rec != nullptr) {
+      Record* next = rec->next;
+      delete rec;
+      rec = next;
+    }
+  }
+
+  EpochManager(EpochManager const&) = delete;
+  EpochManager& operator=(EpochManager const&) = delete;
+
+  static EpochManager& instance() {
+    static EpochManager manager;
+    return manager;
+  }
+
+  void enter() {
+    Record* rec = threadRecord();
+    if (rec->nesting++ > 0) {
+      return;
+    }
+    uint64_t e = _epoch.load(std::memory_order_relaxed);
+    while (true) {
+      rec->epoch.store(e, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      uint64_t now = _epoch.load(std::memory_order_relaxed);
+      if (now == e) {
+        return;
+      }
+      e = now;
+    }
+  }
+
+  void leave() {
+    Record* rec = threadRecord();
+    if (--rec->nesting == 0) {
+      rec->epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  // Frees object with deleter once no reader can reach it anymore. The
+  // object must already be unreachable for readers entering from now on.
+  void retire(void* object, void (*deleter)(void*)) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    {
+      std::lock_guard<std::mutex> guard(_mutex);
+      _retired.push_back(
+          Retired{object, deleter, _epoch.load(std::memory_order_seq_cst)});
+    }
+    collect();
+  }
+
+  template <class T>
+  void retire(T* object) {
+    retire(object, [](void* p) { delete static_cast<T*>(p); });
+  }
+
+  // Advances the epoch if possible and frees what has become unreachable.
+  // Called by retire(), may be called by anybody to free memory earlier.
+  void collect() {
+    std::vector<Retired> ready;
+    {
+      std::lock_guard<std::mutex> guard(_mutex);
+      if (_retired.empty()) {
+        return;
+      }
+      tryAdvance();
+      uint64_t e = _epoch.load(std::memory_order_seq_cst);
+      size_t kept = 0;
+      for (size_t i = 0; i < _retired.size(); ++i) {
+        if (_retired[i].epoch + 2 <= e) {
+          ready.push_back(_retired[i]);
+        } else {
+          _retired[kept++] = _retired[i];
+        }
+      }
+      _retired.resize(kept);
+    }
+    for (Retired const& r : ready) {
+      r.deleter(r.object);
+    }
+  }
+
+  // Number of retired objects not yet freed:
+  size_t nrPending() {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _retired.size();
+  }
+
+ private:
+  // Must be called with _mutex held.
+  void tryAdvance() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t e = _epoch.load(std::memory_order_relaxed);
+    for (Record* rec = _records.load(std::memory_order_acquire);
+         rec != nullptr; rec = rec->next) {
+      uint64_t announced = rec->epoch.load(std::memory_order_acquire);
+      if (announced != 0 && announced != e) {
+        return;  // somebody is still in the previous epoch
+      }
+    }
+    _epoch.store(e + 1, std::memory_order_seq_cst);
+  }
+
+  Record* threadRecord() {
+    static thread_local ThreadHandle handle;
+    if (handle.record == nullptr) {
+      handle.record = acquireRecord();
+    }
+    return handle.record;
+  }
+
+  Record* acquireRecord() {
+    for (Record* rec = _records.load(std::memory_order_acquire);
+         rec != nullptr; rec = rec->next) {
+      bool expected = false;
+      if (!rec->inUse.load(std::memory_order_relaxed) &&
+          rec->inUse.compare_exchange_strong(expected, true)) {
+        return rec;
+      }
+    }
+    Record* rec = new Record();
+    Record* head = _records.load(std::memory_order_relaxed);
+    do {
+      rec->next = head;
+    } while (!_records.compare_exchange_weak(head, rec,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+    return rec;
+  }
+
+  std::atomic<uint64_t> _epoch;
+  std::atomic<Record*> _records;  // never shrinks, records are reused
+  std::mutex _mutex;               // protects _retired
+  std::vector<Retired> _retired;
+};
+
+// Keeps the calling thread in a critical section for its lifetime, may be
+// nested:
+class EpochGuard {
+  EpochManager& _manager;
+
+ public:
+  EpochGuard() : _manager(EpochManager::instance()) { _manager.enter(); }
+
+  ~EpochGuard() { _manager.leave(); }
+
+  EpochGuard(EpochGuard const&) = delete;
+  EpochGuard& operator=(EpochGuard const&) = delete;
+};
+
+#endif
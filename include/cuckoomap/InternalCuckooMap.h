@@ -1,13 +1,16 @@
 #ifndef INTERNAL_CUCKOO_MAP_H
 #define INTERNAL_CUCKOO_MAP_H 1
 
+#include <atomic>
 #include <cstring>
 #include <iostream>
+#include <vector>
 
 #include "CuckooHelpers.h"
+#include "CuckooTracing.h"
 
 // In the following template:
-//   Key is the key type, it must be copyable and movable, furthermore, Key
+//   Key is the key type, it must be movable, furthermore, Key
 //     must be default constructible (without arguments) as empty and
 //     must have an empty() method to indicate that the instance is
 //     empty.
@@ -25,22 +28,49 @@
 //     table no constructors or destructors or assignment operators are
 //     called for Value, the data is only copied with std::memcpy. So Value
 //     must only contain POD!
-// This class is not thread-safe!
+//   SlotsPerBucket is the number of pairs per bucket, it must be a power
+//     of two and at most 128.
+// With SingleHash as HashKey2 the key is hashed only once: HashKey1 picks
+// the first bucket, and the second one is the first XORed with an offset
+// derived from a 16-bit tag of the same hash (partial-key cuckoo hashing
+// as in CuckooFilter). This halves the hashing of every probe and of every
+// expunged pair, but only 2^16 second buckets are possible for each first
+// one, which costs some load factor in very large tables.
+// With StoreTags every slot also keeps 8 bytes of the hashes of its key
+// (bits 16 to 47 of both hashes, or the whole hash in single hash mode),
+// which is all bucketsByHash looks at in tables of up to 2^32 buckets.
+// An expunged pair then comes with its hashes for the next table without
+// hashing its key again, which pays off for long keys.
+// A table with a nonzero seed mixes it into the hashes before it picks
+// buckets, so that keys whose hashes collide in the bits bucketsByHash
+// looks at are spread out anyway (CuckooMap reseeds layers which overflow
+// while mostly empty). Only keys with equal hashes always collide, with
+// StoreTags equal in the bits kept in the tags.
+// This class is not thread-safe! The only exception are lookupInBuckets,
+// insertInBuckets and remove, which may run concurrently as long as no two
+// of them touch a common bucket (CuckooMap ensures this with bucket locks).
 
 template <class Key, class Value,
           class HashKey1 = HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
           class HashKey2 = HashWithSeed<Key, 0xabcdefabcdef1234ULL>,
-          class CompKey = std::equal_to<Key>>
+          class CompKey = std::equal_to<Key>, uint32_t SlotsPerBucket = 2,
+          bool StoreTags = false>
 class InternalCuckooMap {
-  // Note that the following has to be a power of two!
-  static constexpr uint32_t SlotsPerBucket = 2;
+  static_assert(SlotsPerBucket > 0 && SlotsPerBucket <= 128 &&
+                    (SlotsPerBucket & (SlotsPerBucket - 1)) == 0,
+                "SlotsPerBucket must be a power of two <= 128");
+
+  // Expunged pairs per pair that reseed may place:
+  static constexpr int MaxReseedKicks = 20;
 
  public:
   InternalCuckooMap(uint64_t size, size_t valueSize = sizeof(Value),
-                    size_t valueAlign = alignof(Value))
+                    size_t valueAlign = alignof(Value), uint64_t seed = 0)
       : _randState(0x2636283625154737ULL),
         _valueSize(valueSize),
-        _valueAlign(valueAlign) {
+        _valueAlign(valueAlign),
+        _nrUsed(0),
+        _seed(seed) {
     // Sort out offsets and alignments:
     _valueOffset = sizeof(Key);
     size_t mask = _valueAlign - 1;
@@ -53,7 +83,11 @@ class InternalCuckooMap {
     }
     mask = keyAlign - 1;
     _slotSize = _valueOffset + _valueSize;
-    _slotSize = (_slotSize + alignof(Key) - 1) & (~mask);
+    _tagOffset = _slotSize;  // tags are unaligned, only memcpy touches them
+    if (StoreTags) {
+      _slotSize += sizeof(uint64_t);
+    }
+    _slotSize = (_slotSize + keyAlign - 1) & (~mask);
 
     // First find the smallest power of two that is not smaller than size:
     size /= SlotsPerBucket;
@@ -71,13 +105,6 @@ class InternalCuckooMap {
     _base = reinterpret_cast<char*>(
         (reinterpret_cast<uintptr_t>(_allocBase) + 63) & ~((uintptr_t)0x3fu));
 
-    try {
-      _theBuffer = new char[_valueSize];
-    } catch (...) {
-      delete[] _allocBase;
-      throw;
-    }
-
     // Now initialize all slots in all buckets with empty pairs:
     for (uint32_t b = 0; b < _size; ++b) {
       for (size_t i = 0; i < SlotsPerBucket; ++i) {
@@ -98,7 +125,6 @@ class InternalCuckooMap {
       }
     }
     delete[] _allocBase;
-    delete[] _theBuffer;
   }
 
   InternalCuckooMap(InternalCuckooMap const&) = delete;
@@ -106,17 +132,60 @@ class InternalCuckooMap {
   InternalCuckooMap& operator=(InternalCuckooMap const&) = delete;
   InternalCuckooMap& operator=(InternalCuckooMap&&) = delete;
 
-  bool lookup(Key const& k, Key*& kOut, Value*& vOut) {
+  static constexpr bool SingleHashMode = IsSingleHash<HashKey2>::value;
+
+  // K is Key, or anything the transparent hashes and CompKey accept:
+  template <class K>
+  bool lookup(K const& k, Key*& kOut, Value*& vOut) {
     // look up a key, return either false if no pair with key k is
     // found or true. In the latter case the pointers kOut and vOut
     // are set to point to the pair in the table. This pointers are only
     // valid until the next operation on this table is called.
-    uint64_t hash = _hasher1(k);
-    uint64_t pos = hashToPos(hash);
-    // We compute the second hash already here to allow the result to
-    // survive a mispredicted branch in the first loop. Is this sensible?
-    uint64_t hash2 = _hasher2(k);
-    uint64_t pos2 = hashToPos(hash2);
+    uint64_t pos, pos2;
+    buckets(k, pos, pos2);
+    return lookupInBuckets(k, pos, pos2, kOut, vOut);
+  }
+
+  // The two buckets in which a pair with key k can be:
+  template <class K>
+  void buckets(K const& k, uint64_t& pos1, uint64_t& pos2) {
+    CuckooHashPair hash = hashes(k);
+    bucketsByHash(hash.hash1, hash.hash2, pos1, pos2);
+  }
+
+  // The results of HashKey1 and HashKey2 for k (hash2 is 0 in single hash
+  // mode), from which bucketsByHash gives the buckets of k in any table:
+  template <class K>
+  CuckooHashPair hashes(K const& k) {
+    return CuckooHashPair(_hasher1(k), SingleHashMode ? 0 : _hasher2(k));
+  }
+
+  // The same from the results of HashKey1 and HashKey2 (hash2 is ignored
+  // in single hash mode):
+  void bucketsByHash(uint64_t hash1, uint64_t hash2, uint64_t& pos1,
+                     uint64_t& pos2) {
+    bucketsBySeed(hash1, hash2, _seed.load(std::memory_order_relaxed), pos1,
+                  pos2);
+  }
+
+  // Hints the CPU to load the buckets of k into the cache, changes
+  // nothing:
+  template <class K>
+  void prefetch(K const& k) {
+    uint64_t pos1, pos2;
+    buckets(k, pos1, pos2);
+    prefetchBuckets(pos1, pos2);
+  }
+
+  void prefetchBuckets(uint64_t pos1, uint64_t pos2) {
+    prefetchBucket(pos1);
+    prefetchBucket(pos2);
+  }
+
+  // As lookup, but with the buckets of k already computed:
+  template <class K>
+  bool lookupInBuckets(K const& k, uint64_t pos, uint64_t pos2, Key*& kOut,
+                       Value*& vOut) {
     for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
       Key* kTable = findSlotKey(pos, i);
       if (_compKey(*kTable, k)) {
@@ -145,9 +214,10 @@ class InternalCuckooMap {
     // also unchanged. Otherwise, if there has not yet been a pair with
     // key k in the table, true is returned and the new pair is
     // inserted no matter what. If there is no collision then 0 is
-    // returend and k and *v are unchanged. If however, a pair needs
-    // to be expunged from the table, then k and *v are overwritten
-    // with the values of the expunged pair and 1 is returned.
+    // returend, k has been moved into the table and *v is unchanged. If
+    // however, a pair needs to be expunged from the table, then k and *v
+    // are overwritten with the values of the expunged pair (keys are only
+    // moved, never copied) and 1 is returned.
     //
     // If kPtr and vPtr and non-null pointers, and the return is non-negative,
     // the position of k and v in the table are written to *kPtr and *vPtr.
@@ -167,24 +237,36 @@ class InternalCuckooMap {
     //    1  : k, v is now another pair which has been expunged from the
     //         table but the original one is inserted
     //
+    CuckooHashPair hash = hashes(k);
+    uint64_t pos1, pos2;
+    bucketsByHash(hash.hash1, hash.hash2, pos1, pos2);
+    return insertInBuckets(k, v, pos1, pos2, kPtr, vPtr, &hash);
+  }
 
+  // As insert, but with the buckets of k already computed. Only these two
+  // buckets are touched, the expunged pair comes from one of them. If
+  // hash is given, it must be hashes(k) (or the stored hashes of k), and
+  // if a pair is expunged it is set to the hashes of that pair, with
+  // StoreTags from its slot, else by hashing its key.
+  int insertInBuckets(Key& k, Value* v, uint64_t pos1, uint64_t pos2,
+                      Key** kPtr, Value** vPtr,
+                      CuckooHashPair* hash = nullptr) {
     Key* kTable;
     Value* vTable;
-
-    uint64_t hash1 = _hasher1(k);
-    uint64_t pos1 = hashToPos(hash1);
-    // We compute the second hash already here to let it survive a mispredicted
-    // branch in the first loop:
-    uint64_t hash2 = _hasher2(k);
-    uint64_t pos2 = hashToPos(hash2);
+    CuckooHashPair computed(0, 0);
+    if (StoreTags && hash == nullptr) {
+      computed = hashes(k);
+      hash = &computed;
+    }
 
     for (uint64_t i = 0; i < SlotsPerBucket; ++i) {
       kTable = findSlotKey(pos1, i);
       if (kTable->empty()) {
         vTable = findSlotValue(pos1, i);
-        *kTable = k;
+        *kTable = std::move(k);
         std::memcpy(vTable, v, _valueSize);
-        ++_nrUsed;
+        storeTags(pos1, i, hash);
+        _nrUsed.fetch_add(1, std::memory_order_relaxed);
         if (kPtr != nullptr && vPtr != nullptr) {
           *kPtr = kTable;
           *vPtr = vTable;
@@ -199,9 +281,10 @@ class InternalCuckooMap {
       kTable = findSlotKey(pos2, i);
       if (kTable->empty()) {
         vTable = findSlotValue(pos2, i);
-        *kTable = k;
+        *kTable = std::move(k);
         std::memcpy(vTable, v, _valueSize);
-        ++_nrUsed;
+        storeTags(pos2, i, hash);
+        _nrUsed.fetch_add(1, std::memory_order_relaxed);
         if (kPtr != nullptr && vPtr != nullptr) {
           *kPtr = kTable;
           *vPtr = vTable;
@@ -220,14 +303,20 @@ class InternalCuckooMap {
     }
     uint64_t i = (r >> 1) & (SlotsPerBucket - 1);
     // We expunge the element at position pos1 and slot i:
+    CUCKOO_TRACE3(kick, this, pos1, i);
     kTable = findSlotKey(pos1, i);
     vTable = findSlotValue(pos1, i);
     Key kDummy = std::move(*kTable);
     *kTable = std::move(k);
     k = std::move(kDummy);
-    std::memcpy(_theBuffer, vTable, _valueSize);
-    std::memcpy(vTable, v, _valueSize);
-    std::memcpy(v, _theBuffer, _valueSize);
+    swapValues(vTable, v);
+    if (StoreTags) {
+      CuckooHashPair expunged = loadTags(pos1, i);
+      storeTags(pos1, i, hash);
+      *hash = expunged;
+    } else if (hash != nullptr) {
+      *hash = hashes(k);
+    }
     if (kPtr != nullptr && vPtr != nullptr) {
       *kPtr = kTable;
       *vPtr = vTable;
@@ -235,6 +324,28 @@ class InternalCuckooMap {
     return 1;
   }
 
+  // Undoes an insertInBuckets which put a pair into the slot at kSlot
+  // and vSlot and expunged (k, *v) from it: swaps the two pairs back.
+  // *hash are the hashes of (k, *v), as insertInBuckets left them, and
+  // become those of the pair k carries again.
+  void unexpunge(Key* kSlot, Value* vSlot, Key& k, Value* v,
+                 CuckooHashPair* hash) {
+    uint64_t n = (reinterpret_cast<char*>(kSlot) - _base) / _slotSize;
+    uint64_t pos = n / SlotsPerBucket;
+    uint64_t i = n % SlotsPerBucket;
+    Key kDummy = std::move(*kSlot);
+    *kSlot = std::move(k);
+    k = std::move(kDummy);
+    swapValues(vSlot, v);
+    if (StoreTags) {
+      CuckooHashPair expunged = loadTags(pos, i);
+      storeTags(pos, i, hash);
+      *hash = expunged;
+    } else {
+      *hash = hashes(k);
+    }
+  }
+
   void remove(Key* k, Value* v) {
     // remove the pair to which k and v point to in the table, this
     // pointer must have been returned by lookup before and no insert or
@@ -242,10 +353,11 @@ class InternalCuckooMap {
     k->~Key();
     new (k) Key();
     std::memset(v, 0, _valueSize);
-    --_nrUsed;
+    _nrUsed.fetch_sub(1, std::memory_order_relaxed);
   }
 
-  bool remove(Key const& k) {
+  template <class K>
+  bool remove(K const& k) {
     // remove the pair with key k, if one is in the table. Return true if
     // a pair was removed and false otherwise.
     Key* kTable;
@@ -257,13 +369,90 @@ class InternalCuckooMap {
     return true;
   }
 
+  // Switches to seed (see the top of this file) and moves every pair to
+  // its buckets under it, if they all fit there with at most
+  // MaxReseedKicks expunged pairs each, else returns false and changes
+  // nothing. The placement is worked out on the hashes alone before any
+  // pair moves. Not thread-safe, not even with lookupInBuckets.
+  bool reseed(uint64_t seed) {
+    uint64_t const Free = ~uint64_t(0);
+    uint64_t n = capacity();
+    std::vector<uint64_t> from;  // the slot of every pair
+    std::vector<CuckooHashPair> keyHashes;
+    from.reserve(nrUsed());
+    keyHashes.reserve(nrUsed());
+    for (uint64_t s = 0; s < n; ++s) {
+      uint64_t b = s / SlotsPerBucket;
+      uint64_t i = s % SlotsPerBucket;
+      Key* k = findSlotKey(b, i);
+      if (!k->empty()) {
+        from.push_back(s);
+        keyHashes.push_back(StoreTags ? loadTags(b, i) : hashes(*k));
+      }
+    }
+    // to[s] is the pair which goes to slot s, cuckoo hashing on indices:
+    std::vector<uint64_t> to(n, Free);
+    for (uint64_t j = 0; j < from.size(); ++j) {
+      uint64_t carried = j;
+      for (int count = 0; carried != Free; ++count) {
+        if (count == MaxReseedKicks) {
+          return false;
+        }
+        uint64_t pos1, pos2;
+        bucketsBySeed(keyHashes[carried].hash1, keyHashes[carried].hash2,
+                      seed, pos1, pos2);
+        uint64_t s = Free;
+        for (uint64_t i = 0; i < 2 * SlotsPerBucket && s == Free; ++i) {
+          uint64_t t = (i < SlotsPerBucket ? pos1 : pos2) * SlotsPerBucket +
+                       i % SlotsPerBucket;
+          if (to[t] == Free) {
+            s = t;
+          }
+        }
+        if (s == Free) {
+          uint8_t r = pseudoRandomChoice();
+          s = ((r & 1) != 0 ? pos2 : pos1) * SlotsPerBucket +
+              ((r >> 1) & (SlotsPerBucket - 1));
+        }
+        std::swap(carried, to[s]);
+      }
+    }
+    std::vector<Key> keys;
+    std::vector<char> values(from.size() * _valueSize);
+    keys.reserve(from.size());
+    for (uint64_t j = 0; j < from.size(); ++j) {
+      Key* k = findSlotKey(from[j] / SlotsPerBucket, from[j] % SlotsPerBucket);
+      Value* v =
+          findSlotValue(from[j] / SlotsPerBucket, from[j] % SlotsPerBucket);
+      std::memcpy(&values[j * _valueSize], v, _valueSize);
+      keys.push_back(std::move(*k));
+      remove(k, v);
+    }
+    _seed.store(seed, std::memory_order_relaxed);
+    for (uint64_t s = 0; s < n; ++s) {
+      if (to[s] == Free) {
+        continue;
+      }
+      uint64_t b = s / SlotsPerBucket;
+      uint64_t i = s % SlotsPerBucket;
+      *findSlotKey(b, i) = std::move(keys[to[s]]);
+      std::memcpy(findSlotValue(b, i), &values[to[s] * _valueSize],
+                  _valueSize);
+      storeTags(b, i, &keyHashes[to[s]]);
+      _nrUsed.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  uint64_t seed() { return _seed.load(std::memory_order_relaxed); }
+
   uint64_t capacity() { return _size * SlotsPerBucket; }
 
-  uint64_t nrUsed() { return _nrUsed; }
+  uint64_t nrBuckets() { return _size; }
 
-  uint64_t memoryUsage() {
-    return sizeof(InternalCuckooMap) + _allocSize + _valueSize;
-  }
+  uint64_t nrUsed() { return _nrUsed.load(std::memory_order_relaxed); }
+
+  uint64_t memoryUsage() { return sizeof(InternalCuckooMap) + _allocSize; }
 
  private:  // methods
   Key* findSlotKey(uint64_t pos, uint64_t slot) {
@@ -281,6 +470,40 @@ class InternalCuckooMap {
     return ret;
   }
 
+  // The tags of StoreTags, see the top of this file. Two hashes keep bits
+  // 16 to 47 of each, which are the only ones hashToPos uses for up to
+  // 2^32 buckets, the single hash is kept whole for alternatePos:
+  void storeTags(uint64_t pos, uint64_t slot, CuckooHashPair const* hash) {
+    if (!StoreTags) {
+      return;
+    }
+    uint64_t tags = SingleHashMode
+                        ? hash->hash1
+                        : ((hash->hash1 >> 16) & 0xffffffffULL) |
+                              ((hash->hash2 >> 16) << 32);
+    std::memcpy(reinterpret_cast<char*>(findSlotKey(pos, slot)) + _tagOffset,
+                &tags, sizeof(tags));
+  }
+
+  CuckooHashPair loadTags(uint64_t pos, uint64_t slot) {
+    uint64_t tags;
+    std::memcpy(&tags,
+                reinterpret_cast<char*>(findSlotKey(pos, slot)) + _tagOffset,
+                sizeof(tags));
+    if (SingleHashMode) {
+      return CuckooHashPair(tags, 0);
+    }
+    return CuckooHashPair((tags & 0xffffffffULL) << 16, (tags >> 32) << 16);
+  }
+
+  // A bucket may span two cache lines, the slots are 64-byte aligned
+  // only as a whole:
+  void prefetchBucket(uint64_t pos) {
+    char const* first = _base + _slotSize * pos * SlotsPerBucket;
+    __builtin_prefetch(first, 0, 3);
+    __builtin_prefetch(first + _slotSize * SlotsPerBucket - 1, 0, 3);
+  }
+
   bool check(void* p, bool isKey) {
     char* address = reinterpret_cast<char*>(p);
     if ((address - _allocBase) + (isKey ? _slotSize : _valueSize) - 1 >=
@@ -293,18 +516,66 @@ class InternalCuckooMap {
 
   uint64_t hashToPos(uint64_t hash) { return (hash >> _sizeShift) & _sizeMask; }
 
+  // bucketsByHash as if the table had this seed:
+  void bucketsBySeed(uint64_t hash1, uint64_t hash2, uint64_t seed,
+                     uint64_t& pos1, uint64_t& pos2) {
+    if (seed != 0) {
+      hash1 = seeded(hash1, seed);
+      hash2 = seeded(hash2, seed);
+    }
+    pos1 = hashToPos(hash1);
+    pos2 = SingleHashMode ? alternatePos(pos1, hash1) : hashToPos(hash2);
+  }
+
+  // A hash mixed with the seed. With StoreTags in two hash mode only the
+  // bits kept in the tags count, so that stored hashes give the same
+  // buckets:
+  static uint64_t seeded(uint64_t hash, uint64_t seed) {
+    if (StoreTags && !SingleHashMode) {
+      hash = (hash >> 16) & 0xffffffffULL;
+    }
+    return cuckooFinalize(hash ^ seed);
+  }
+
+  // The other bucket of a key with this hash in single hash mode. The tag
+  // is the top 16 bits, which hashToPos only uses beyond 2^32 buckets. The
+  // offset is never 0, so the two buckets differ, and it only depends on
+  // the tag, so either bucket gives the other.
+  uint64_t alternatePos(uint64_t pos, uint64_t hash) {
+    uint64_t offset = hashToPos((hash >> 48) * 0xc6a4a7935bd1e995ULL);
+    return pos ^ (offset == 0 ? 1 : offset);
+  }
+
   uint8_t pseudoRandomChoice() {
-    _randState = _randState * 997 + 17;  // ignore overflows
-    return static_cast<uint8_t>((_randState >> 37) & 0xff);
+    // Concurrent inserts may lose updates, which does not matter here:
+    uint64_t r = _randState.load(std::memory_order_relaxed) * 997 + 17;
+    _randState.store(r, std::memory_order_relaxed);  // ignore overflows
+    return static_cast<uint8_t>((r >> 37) & 0xff);
+  }
+
+  // Swaps the values at a and b through a small buffer on the stack, so
+  // that concurrent inserts need no shared one:
+  void swapValues(Value* a, Value* b) {
+    char* x = reinterpret_cast<char*>(a);
+    char* y = reinterpret_cast<char*>(b);
+    char buffer[64];
+    for (size_t done = 0; done < _valueSize; done += sizeof(buffer)) {
+      size_t n = _valueSize - done < sizeof(buffer) ? _valueSize - done
+                                                      : sizeof(buffer);
+      std::memcpy(buffer, x + done, n);
+      std::memcpy(x + done, y + done, n);
+      std::memcpy(y + done, buffer, n);
+    }
   }
 
  private:               // member variables
-  uint64_t _randState;  // pseudo random state for expunging
+  std::atomic<uint64_t> _randState;  // pseudo random state for expunging
 
   size_t _valueSize;    // size in bytes reserved for one element
   size_t _valueAlign;   // alignment for value type
   size_t _slotSize;     // total size of a slot
   size_t _valueOffset;  // offset from start of slot to value start
+  size_t _tagOffset;    // offset from start of slot to the tags
 
   uint64_t _logSize;    // logarithm (base 2) of number of buckets
   uint64_t _size;       // number of buckets, == 2^_logSize
@@ -314,8 +585,8 @@ class InternalCuckooMap {
                         // == _size * SlotsPerBucket * _slotSize + 64
   char* _base;          // pointer to allocated space, 64-byte aligned
   char* _allocBase;     // base of original allocation
-  char* _theBuffer;     // pointer to an area of size _valueSize for value swap
-  uint64_t _nrUsed;     // number of pairs stored in the table
+  std::atomic<uint64_t> _nrUsed;  // number of pairs stored in the table
+  std::atomic<uint64_t> _seed;    // mixed into the hashes, 0 for none
 
   HashKey1 _hasher1;  // Instance to compute the first hash function
   HashKey2 _hasher2;  // Instance to compute the second hash function
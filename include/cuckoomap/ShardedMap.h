@@ -1,6 +1,15 @@
 #ifndef SHARDED_MAP_H
 #define SHARDED_MAP_H 1
 
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "CuckooCoroutines.h"
+#include "CuckooHelpers.h"
+#include "CuckooStatistics.h"
+
 template<class InternalMap>
 class ShardedMap {
 
@@ -8,12 +17,21 @@ class ShardedMap {
   uint32_t _nrShards;       // = 2^_logNrShards
   uint64_t _shardMask;      // = _nrShards - 1
 
+  // For the heterogeneous overloads, see CuckooMap:
+  template <class K>
+  using EnableIfTransparentKey =
+      EnableIfTransparent<typename InternalMap::HashKey1Type,
+                          typename InternalMap::HashKey2Type,
+                          typename InternalMap::CompKeyType, K>;
+
  public:
 
   ShardedMap(size_t firstSize,
              uint32_t nrShards = 8,
              size_t valueSize = sizeof(typename InternalMap::ValueType),
-             size_t valueAlign = alignof(typename InternalMap::ValueType)) {
+             size_t valueAlign = alignof(typename InternalMap::ValueType),
+             typename InternalMap::PolicyType const& policy =
+                 typename InternalMap::PolicyType()) {
 
     _logNrShards = 0;
     _nrShards = 1;
@@ -23,9 +41,10 @@ class ShardedMap {
     }
     _shardMask = _nrShards - 1;
 
+    _counters.reset(new ShardCounters[_nrShards]);
     _tables.reserve(_nrShards);
     for (uint32_t s = 0; s < _nrShards; ++s) {
-      auto t = new InternalMap(firstSize, valueSize, valueAlign);
+      auto t = new InternalMap(firstSize, valueSize, valueAlign, policy);
       try {
         _tables.emplace_back(t);
       } catch (...) {
@@ -38,6 +57,15 @@ class ShardedMap {
   typename InternalMap::Finding lookup(typename InternalMap::KeyType const& k) {
     uint32_t shard = findShard(k);
     InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.lookup(k);
+  }
+
+  template <class K, class = EnableIfTransparentKey<K>>
+  typename InternalMap::Finding lookup(K const& k) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
     return t.lookup(k);
   }
 
@@ -45,33 +73,255 @@ class ShardedMap {
               typename InternalMap::Finding& f) {
     uint32_t shard = findShard(k);
     InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
     return t.lookup(k, f);
   }
 
+  // Lock-free lookup in the shard, see CuckooMap::lookupCopy:
+  bool lookupCopy(typename InternalMap::KeyType const& k,
+                  typename InternalMap::ValueType* v) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.lookupCopy(k, v);
+  }
+
+  template <class K, class = EnableIfTransparentKey<K>>
+  bool lookupCopy(K const& k, typename InternalMap::ValueType* v) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.lookupCopy(k, v);
+  }
+
   bool insert(typename InternalMap::KeyType const& k,
               typename InternalMap::ValueType const* v) {
     uint32_t shard = findShard(k);
     InternalMap& t = *_tables[shard];
+    _counters[shard].inserts.add(1);
     return t.insert(k, v);
   }
 
+  // Moves k into the shard, see CuckooMap:
+  bool insert(typename InternalMap::KeyType&& k,
+              typename InternalMap::ValueType const* v) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].inserts.add(1);
+    return t.insert(std::move(k), v);
+  }
+
+  template <class... Args>
+  bool emplace(typename InternalMap::ValueType const* v, Args&&... keyArgs) {
+    return insert(
+        typename InternalMap::KeyType(std::forward<Args>(keyArgs)...), v);
+  }
+
   bool insert(typename InternalMap::KeyType const& k,
               typename InternalMap::ValueType const* v,
               typename InternalMap::Finding& f) {
     uint32_t shard = findShard(k);
     InternalMap& t = *_tables[shard];
+    _counters[shard].inserts.add(1);
     return t.insert(k, v, f);
   }
 
+  // Read-modify-write operations in the shard, see CuckooMap, all counted
+  // as inserts:
+
+  bool insertOrAssign(typename InternalMap::KeyType const& k,
+                      typename InternalMap::ValueType const* v) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].inserts.add(1);
+    return t.insertOrAssign(k, v);
+  }
+
+  template <class... Args>
+  bool tryEmplace(typename InternalMap::KeyType const& k, Args&&... args) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].inserts.add(1);
+    return t.tryEmplace(k, std::forward<Args>(args)...);
+  }
+
+  template <class Factory>
+  bool computeIfAbsent(typename InternalMap::KeyType const& k,
+                       Factory factory) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].inserts.add(1);
+    return t.computeIfAbsent(k, factory);
+  }
+
+  template <class Merge>
+  bool upsert(typename InternalMap::KeyType const& k,
+              typename InternalMap::ValueType const* v, Merge merge) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].inserts.add(1);
+    return t.upsert(k, v, merge);
+  }
+
+  // Atomic operations on a value field in the shard, see CuckooMap:
+
+  template <class T>
+  bool fetchAdd(typename InternalMap::KeyType const& k,
+                T InternalMap::ValueType::*field, T delta,
+                T* previous = nullptr) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.fetchAdd(k, field, delta, previous);
+  }
+
+  template <class T>
+  bool fetchOr(typename InternalMap::KeyType const& k,
+               T InternalMap::ValueType::*field, T bits,
+               T* previous = nullptr) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.fetchOr(k, field, bits, previous);
+  }
+
+  template <class T>
+  bool compareExchange(typename InternalMap::KeyType const& k,
+                       T InternalMap::ValueType::*field, T& expected,
+                       T desired) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.compareExchange(k, field, expected, desired);
+  }
+
+  // Runs visitor on the value(s) with key k in the shard, see
+  // CuckooMap::visit:
+  template <class Visitor>
+  bool visit(typename InternalMap::KeyType const& k, Visitor visitor) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.visit(k, visitor);
+  }
+
+  template <class K, class Visitor, class = EnableIfTransparentKey<K>>
+  bool visit(K const& k, Visitor visitor) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.visit(k, visitor);
+  }
+
+  template <class Updater>
+  bool update(typename InternalMap::KeyType const& k, Updater updater) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.update(k, updater);
+  }
+
+  template <class K, class Updater, class = EnableIfTransparentKey<K>>
+  bool update(K const& k, Updater updater) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.update(k, updater);
+  }
+
   bool remove(typename InternalMap::KeyType const& k) {
     uint32_t shard = findShard(k);
     InternalMap& t = *_tables[shard];
+    _counters[shard].removes.add(1);
     return t.remove(k);
   }
 
+  template <class K, class = EnableIfTransparentKey<K>>
+  bool remove(K const& k) {
+    uint32_t shard = findShard(k);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].removes.add(1);
+    return t.remove(k);
+  }
+
+#if CUCKOO_MAP_COROUTINES
+  // Interleavable lookup in the shard, see CuckooMap::co_lookup:
+  CuckooLookupTask co_lookup(typename InternalMap::KeyType const& k,
+                             typename InternalMap::ValueType* v) {
+    uint32_t shard = findShard(k);
+    _counters[shard].lookups.add(1);
+    return _tables[shard]->co_lookup(k, v);
+  }
+#endif
+
+  // See CuckooMap::prefetch:
+  void prefetch(typename InternalMap::KeyType const& k) {
+    _tables[findShard(k)]->prefetch(k);
+  }
+
+  // With the hashes of k precomputed, see CuckooMap::lookupByHash. The
+  // first hash also picks the shard:
+  typename InternalMap::Finding lookupByHash(
+      typename InternalMap::KeyType const& k, CuckooHashPair const& hash) {
+    uint32_t shard = shardOfHash(hash.hash1);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].lookups.add(1);
+    return t.lookupByHash(k, hash);
+  }
+
+  bool insertByHash(typename InternalMap::KeyType const& k,
+                    typename InternalMap::ValueType const* v,
+                    CuckooHashPair const& hash) {
+    uint32_t shard = shardOfHash(hash.hash1);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].inserts.add(1);
+    return t.insertByHash(k, v, hash);
+  }
+
+  bool removeByHash(typename InternalMap::KeyType const& k,
+                    CuckooHashPair const& hash) {
+    uint32_t shard = shardOfHash(hash.hash1);
+    InternalMap& t = *_tables[shard];
+    _counters[shard].removes.add(1);
+    return t.removeByHash(k, hash);
+  }
+
+  // See CuckooMap::lookupCopyBatch, the hashes of a batch also route its
+  // keys to their shards:
+  size_t lookupCopyBatch(typename InternalMap::KeyType const* keys, size_t n,
+                         typename InternalMap::ValueType* values,
+                         bool* found) {
+    static constexpr size_t BatchSize = 16;
+    uint64_t hash1[BatchSize];
+    uint64_t hash2[BatchSize];
+    uint32_t shards[BatchSize];
+    size_t hits = 0;
+    for (size_t start = 0; start < n; start += BatchSize) {
+      size_t m = n - start < BatchSize ? n - start : BatchSize;
+      CuckooBatchHasher<typename InternalMap::HashKey1Type,
+                        typename InternalMap::HashKey2Type>::
+          hash(_hasher1, _hasher2, keys + start, m, hash1, hash2);
+      for (size_t i = 0; i < m; ++i) {
+        shards[i] = shardOfHash(hash1[i]);
+        _tables[shards[i]]->prefetchByHash(keys[start + i],
+                                           CuckooHashPair(hash1[i], hash2[i]));
+      }
+      for (size_t i = 0; i < m; ++i) {
+        _counters[shards[i]].lookups.add(1);
+        bool f = _tables[shards[i]]->lookupCopyByHash(
+            keys[start + i], &values[start + i],
+            CuckooHashPair(hash1[i], hash2[i]));
+        found[start + i] = f;
+        hits += f ? 1 : 0;
+      }
+    }
+    return hits;
+  }
+
   bool remove(typename InternalMap::Finding& f) {
     uint32_t shard = findShard(*f.key());
     InternalMap& t = *_tables[shard];
+    _counters[shard].removes.add(1);
     return t.remove(f);
   }
 
@@ -83,10 +333,41 @@ class ShardedMap {
     return res;
   }
 
+  uint64_t memoryUsage() const {
+    uint64_t res = sizeof(ShardedMap) +
+                   _tables.capacity() * sizeof(std::unique_ptr<InternalMap>) +
+                   _nrShards * sizeof(ShardCounters);
+    for (size_t shard = 0; shard < _tables.size(); ++shard) {
+      res += _tables[shard]->memoryUsage();
+    }
+    return res;
+  }
+
+  // Returns the operation counts and statistics of every shard and the
+  // statistics merged over all shards, for example to spot hot shards.
+  ShardedMapStats stats() const {
+    ShardedMapStats s;
+    for (uint32_t shard = 0; shard < _nrShards; ++shard) {
+      ShardStats shardStats;
+      shardStats.lookups = _counters[shard].lookups.get();
+      shardStats.inserts = _counters[shard].inserts.get();
+      shardStats.removes = _counters[shard].removes.get();
+      shardStats.map = _tables[shard]->stats();
+      s.total.merge(shardStats.map);
+      s.shards.push_back(shardStats);
+    }
+    return s;
+  }
+
  private:
 
-  uint32_t findShard(typename InternalMap::KeyType const& k) {
-    uint64_t hash = _hasher1(k);
+  // K is a key or a heterogeneous probe, which hashes alike:
+  template <class K>
+  uint32_t findShard(K const& k) {
+    return shardOfHash(_hasher1(k));
+  }
+
+  uint32_t shardOfHash(uint64_t hash) {
     hash = hash ^ (hash >> 32);
     hash = hash ^ (hash >> 16);
     if (_logNrShards <= 8) {
@@ -97,8 +378,17 @@ class ShardedMap {
     }
   }
     
+  // Every counter has its own cache line, see StatisticsCounter:
+  struct ShardCounters {
+    StatisticsCounter lookups;
+    StatisticsCounter inserts;
+    StatisticsCounter removes;
+  };
+
   std::vector<std::unique_ptr<InternalMap>> _tables;
+  std::unique_ptr<ShardCounters[]> _counters;
   typename InternalMap::HashKey1Type _hasher1;
+  typename InternalMap::HashKey2Type _hasher2;  // for lookupCopyBatch
 };
 
 #endif
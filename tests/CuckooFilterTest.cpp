@@ -30,6 +30,7 @@ int main(int argc, char* argv[]) {
   auto show = [&]() {
     for (int i = 99; i >= 0; --i) {
       Key k(i);
+      m.prefetch(Key(i - 1));
       if (m.lookup(k)) {
         std::cout << "Found key " << i << std::endl;
       } else {
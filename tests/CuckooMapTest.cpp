@@ -1,6 +1,12 @@
+#include <atomic>
 #include <cassert>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
+#include <cuckoomap/CuckooHashes.h>
 #include <cuckoomap/CuckooMap.h>
 
 struct Key {
@@ -18,6 +24,43 @@ struct equal_to<Key> {
 };
 }
 
+// Transparent functors, so that the map can also be probed with a plain
+// int:
+template <uint64_t Seed>
+struct IntKeyHash {
+  typedef void is_transparent;
+  uint64_t operator()(int i) const { return fasthash64(&i, sizeof(i), Seed); }
+  uint64_t operator()(Key const& k) const { return (*this)(k.k); }
+};
+
+struct IntKeyEqual {
+  typedef void is_transparent;
+  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+  bool operator()(Key const& a, int b) const { return a.k == b; }
+};
+
+// A move-only key owning a heap buffer:
+struct OwnedKey {
+  std::unique_ptr<int> p;
+  OwnedKey() {}
+  explicit OwnedKey(int i) : p(new int(i)) {}
+  bool empty() { return !p; }
+};
+
+template <uint64_t Seed>
+struct OwnedKeyHash {
+  uint64_t operator()(OwnedKey const& k) const {
+    int i = k.p ? *k.p : 0;
+    return fasthash64(&i, sizeof(i), Seed);
+  }
+};
+
+struct OwnedKeyEqual {
+  bool operator()(OwnedKey const& a, OwnedKey const& b) const {
+    return a.p && b.p && *a.p == *b.p;
+  }
+};
+
 struct Value {
   int v;
   Value() : v(0) {}
@@ -25,6 +68,174 @@ struct Value {
   bool empty() { return v == 0; }
 };
 
+// Counts its calls, to see when keys are hashed:
+template <uint64_t Seed>
+struct CountingHash {
+  static std::atomic<uint64_t> calls;
+  uint64_t operator()(Key const& k) const {
+    calls.fetch_add(1);
+    return fasthash64(&k.k, sizeof(k.k), Seed);
+  }
+};
+
+template <uint64_t Seed>
+std::atomic<uint64_t> CountingHash<Seed>::calls(0);
+
+// Only the low 32 bits vary, so that all small keys collide in the bits
+// the layers pick buckets by, as if they had been chosen to:
+template <uint64_t Flip>
+struct WeakHash {
+  uint64_t operator()(Key const& k) const {
+    return static_cast<uint32_t>(k.k) ^ Flip;
+  }
+};
+
+// All keys collide in every layer, whatever its seed:
+struct ConstantHash {
+  uint64_t operator()(Key const&) const { return 0x0123456789abcdefULL; }
+};
+
+// Inserts 1, ..., n - 1 and returns how often HashKey1 was called:
+template <class Map>
+uint64_t hashCallsOfInserts(Map& map, int n) {
+  typedef typename Map::HashKey1Type Hash;
+  Hash::calls = 0;
+  for (int i = 1; i < n; ++i) {
+    Value v(i);
+    map.insert(Key(i), &v);
+  }
+  uint64_t calls = Hash::calls.load();
+  for (int i = 1; i < n; ++i) {
+    Value v;
+    assert(map.lookupCopy(Key(i), &v) && v.v == i);
+  }
+  return calls;
+}
+
+// A key of several words, the last one only partly used:
+struct WideKey {
+  uint32_t w[5];
+};
+
+// Every hashBatch kernel the CPU has computes what BatchHash does:
+template <class T>
+void checkBatchKernels(std::vector<T> const& keys) {
+  size_t n = keys.size();
+  std::vector<uint64_t> expected1(n), expected2(n), out1(n), out2(n);
+  hashBatchScalar<7>(keys.data(), n, expected1.data(), expected2.data());
+  for (size_t i = 0; i < n; ++i) {
+    CuckooHashPair pair(BatchHash<T, 7>()(keys[i]));
+    assert(expected1[i] == pair.hash1 && expected2[i] == pair.hash2);
+  }
+  hashBatch<7>(keys.data(), n, out1.data(), out2.data());
+  assert(out1 == expected1 && out2 == expected2);
+#if CUCKOO_HASH_X86
+  if (cuckooCpuHasAvx2()) {
+    hashBatchAvx2<7>(keys.data(), n, out1.data(), out2.data());
+    assert(out1 == expected1 && out2 == expected2);
+  }
+  if (cuckooCpuHasAvx512()) {
+    hashBatchAvx512<7>(keys.data(), n, out1.data(), nullptr);
+    assert(out1 == expected1);
+  }
+#endif
+}
+
+// lookupCopyBatch over hits and misses:
+template <class Map>
+void checkLookupCopyBatch(Map& map) {
+  for (int i = 1; i < 1000; ++i) {
+    Value v(i);
+    map.insert(Key(i), &v);
+  }
+  std::vector<Key> keys;
+  for (int i = 1; i < 2000; ++i) {
+    keys.push_back(Key(i));
+  }
+  std::vector<Value> values(keys.size());
+  std::unique_ptr<bool[]> found(new bool[keys.size()]);
+  size_t hits =
+      map.lookupCopyBatch(keys.data(), keys.size(), values.data(), found.get());
+  assert(hits == 999);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    assert(found[i] == (keys[i].k < 1000));
+    assert(!found[i] || values[i].v == keys[i].k);
+  }
+  (void)hits;
+}
+
+// Fills a map with the hash policies of CuckooHashes.h and finds
+// everything again:
+template <class HashKey1, class HashKey2>
+void checkHashPolicies() {
+  CuckooMap<Key, Value, HashKey1, HashKey2> map(16);
+  for (int i = 1; i < 2000; ++i) {
+    Value v(i);
+    if (!map.insert(Key(i), &v)) {
+      assert(false);
+    }
+  }
+  for (int i = 1; i < 2000; ++i) {
+    auto f = map.lookup(Key(i));
+    assert(f.found() == 1 && f.value()->v == i);
+  }
+  assert(map.nrUsed() == 1999);
+}
+
+// Inserts the keys [from, to) with themselves as values and finds them all
+// again without the mutex:
+template <class Map>
+void insertAndFind(Map& map, int from, int to) {
+  for (int i = from; i < to; ++i) {
+    Value v(i);
+    if (!map.insert(Key(i), &v)) {
+      assert(false);
+    }
+  }
+  for (int i = from; i < to; ++i) {
+    Value v;
+    bool found = map.lookupCopy(Key(i), &v);
+    assert(found && v.v == i);
+    (void)found;
+  }
+}
+
+// Grows a map of colliding keys to policy.maxLayers layers, after which
+// inserts throw and promotions stay put, with all pairs kept:
+template <class Map>
+void checkLayerLimit() {
+  CuckooMapPolicy policy;
+  policy.maxLayers = 3;
+  Map map(16, sizeof(Value), alignof(Value), policy);
+  // Every layer has room for the two slots of a single bucket:
+  insertAndFind(map, 1, 7);
+  assert(map.nrLayers() == 3);
+  for (int i = 7; i < 10; ++i) {
+    Value v(i);
+    bool thrown = false;
+    try {
+      map.insert(Key(i), &v);
+    } catch (std::length_error const&) {
+      thrown = true;
+    }
+    assert(thrown);
+    (void)thrown;
+  }
+  assert(map.nrUsed() == 6 && map.nrLayers() == 3);
+  for (int i = 1; i < 10; ++i) {
+    auto f = map.lookup(Key(i));
+    assert(f.found() == (i < 7 ? 1 : 0));
+    assert(i >= 7 || f.value()->v == i);
+  }
+  assert(map.nrUsed() == 6);
+  for (int i = 1; i < 7; ++i) {
+    Value v;
+    bool found = map.lookupCopy(Key(i), &v);
+    assert(found && v.v == i);
+    (void)found;
+  }
+}
+
 int main(int argc, char* argv[]) {
   CuckooMap<Key, Value> m(16);
   auto insert = [&]() -> void {
@@ -65,9 +276,498 @@ int main(int argc, char* argv[]) {
       }
     }
   };
+  auto visit = [&]() {
+    for (int i = 1; i < 100; ++i) {
+      int seen = 0;
+      bool found = m.visit(Key(i), [&seen](Value const* v) { seen = v->v; });
+      assert(found == (i >= 50) && (!found || seen == i * i));
+      if (found && !m.update(Key(i), [](Value* v) { v->v = -v->v; })) {
+        assert(false);
+      }
+    }
+    for (int i = 50; i < 100; ++i) {
+      auto f = m.lookup(Key(i));
+      assert(f.found() && f.value()->v == -i * i);
+      f.value()->v = i * i;
+    }
+  };
+  auto stats = [&]() {
+    CuckooMapStats s = m.stats();
+    std::cout << s;
+    assert(s.nrUsed == m.nrUsed());
+    assert(s.layers.size() == m.nrLayers());
+    uint64_t used = 0;
+    for (auto const& l : s.layers) {
+      used += l.nrUsed;
+    }
+    assert(used == s.nrUsed);
+    assert(m.memoryUsage() > s.memoryUsage);
+#if CUCKOO_MAP_STATISTICS
+    assert(s.lookups == 99 * 2 + 49 + 99 + 50 + 50);
+    assert(s.newLayers + 1 == s.layers.size() + s.retiredLayers);
+#endif
+  };
+  auto policy = [&]() {
+    CuckooMapPolicy p;
+    p.growthFactor = 2;
+    p.promotion = CuckooMapPolicy::PromoteNever;
+    CuckooMap<Key, Value, HashWithSeed<Key, 0xdeadbeefdeadbeefULL>,
+              HashWithSeed<Key, 0xabcdefabcdef1234ULL>, std::equal_to<Key>, 4>
+        pm(16, sizeof(Value), alignof(Value), p);
+    for (int i = 1; i < 1000; ++i) {
+      Value v(i);
+      if (!pm.insert(Key(i), &v)) {
+        assert(false);
+      }
+    }
+    for (int i = 1; i < 1000; ++i) {
+      auto f = pm.lookup(Key(i));
+      assert(f.found() && f.value()->v == i);
+    }
+    CuckooMapStats s = pm.stats();
+    assert(s.nrUsed == 999);
+    assert(s.layers.size() > 1);
+    for (size_t layer = 1; layer < s.layers.size(); ++layer) {
+      assert(s.layers[layer].capacity == 2 * s.layers[layer - 1].capacity);
+    }
+    assert(s.promotions == 0);
+  };
+  auto optimistic = [&]() {
+    // Readers look up stable keys without the mutex while a writer grows
+    // and shrinks the cascade and promotes the stable keys around:
+    CuckooMap<Key, Value> om(16);
+    for (int i = 1; i <= 100; ++i) {
+      Value v(i * i);
+      if (!om.insert(Key(i), &v)) {
+        assert(false);
+      }
+    }
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> wrong(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t) {
+      readers.emplace_back([&om, &stop, &wrong, t]() {
+        for (int i = t; !stop.load(); i = i % 100 + 1) {
+          Value v;
+          if (!om.lookupCopy(Key(i % 100 + 1), &v) ||
+              v.v != (i % 100 + 1) * (i % 100 + 1)) {
+            wrong.fetch_add(1);
+          }
+          if (om.lookupCopy(Key(-i - 1), &v)) {
+            wrong.fetch_add(1);
+          }
+        }
+      });
+    }
+    for (int round = 0; round < 20; ++round) {
+      for (int i = 1000; i < 3000; ++i) {
+        Value v(i);
+        if (!om.insert(Key(i), &v)) {
+          assert(false);
+        }
+        om.lookup(Key(i % 100 + 1));
+      }
+      for (int i = 1000; i < 3000; ++i) {
+        if (!om.remove(Key(i))) {
+          assert(false);
+        }
+      }
+    }
+    stop.store(true);
+    for (auto& t : readers) {
+      t.join();
+    }
+    std::cout << "optimistic lookups: " << wrong.load() << " wrong, "
+              << om.stats() << std::flush;
+    assert(wrong.load() == 0);
+    assert(om.nrUsed() == 100);
+#if CUCKOO_MAP_STATISTICS
+    assert(om.stats().retiredLayers > 0);
+#endif
+    EpochManager::instance().collect();
+    EpochManager::instance().collect();
+    assert(EpochManager::instance().nrPending() == 0);
+  };
+  auto readModifyWrite = [&]() {
+    CuckooMap<Key, Value> rm(16);
+    Value one(1);
+    auto add = [](Value* existing, Value const* v) { existing->v += v->v; };
+    Value v(7);
+    bool called = false;
+    bool inserted[8] = {
+        rm.upsert(Key(1), &one, add),
+        rm.upsert(Key(1), &one, add),
+        rm.insertOrAssign(Key(1), &v),
+        rm.insertOrAssign(Key(2), &v),
+        rm.tryEmplace(Key(2), 8),
+        rm.tryEmplace(Key(3), 9),
+        rm.computeIfAbsent(Key(3), [&called](Value*) { called = true; }),
+        rm.computeIfAbsent(Key(4), [](Value* fresh) { fresh->v = 16; })};
+    bool expected[8] = {true, false, false, true, false, true, false, true};
+    for (int i = 0; i < 8; ++i) {
+      if (inserted[i] != expected[i]) {
+        assert(false);
+      }
+    }
+    assert(!called);
+    for (int i = 1; i <= 4; ++i) {
+      Value got;
+      if (!rm.lookupCopy(Key(i), &got)) {
+        assert(false);
+      }
+      assert(got.v == (i == 1 || i == 2 ? 7 : i * i));
+    }
+    // Counters incremented concurrently lose no updates and get no
+    // duplicate keys, also while the cascade grows:
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&rm, &add, &one]() {
+        for (int round = 0; round < 20; ++round) {
+          for (int i = 100; i < 600; ++i) {
+            rm.upsert(Key(i), &one, add);
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    assert(rm.nrUsed() == 4 + 500);
+    for (int i = 100; i < 600; ++i) {
+      Value got;
+      if (!rm.lookupCopy(Key(i), &got)) {
+        assert(false);
+      }
+      assert(got.v == 4 * 20);
+    }
+  };
+  auto atomics = [&]() {
+    CuckooMap<Key, Value> am(16);
+    for (int i = 1; i <= 300; ++i) {
+      Value zero(0);
+      if (!am.insert(Key(i), &zero)) {
+        assert(false);
+      }
+    }
+    // Increments race with inserts which kick the counters around:
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&am, t]() {
+        for (int round = 0; round < 10; ++round) {
+          for (int i = 1; i <= 300; ++i) {
+            am.fetchAdd(Key(i), &Value::v, 1);
+          }
+          for (int i = 0; i < 100; ++i) {
+            Value v(i);
+            am.insertOrAssign(Key(10000 * (t + 1) + i), &v);
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    int previous = 0;
+    if (!am.fetchAdd(Key(1), &Value::v, 0, &previous)) {
+      assert(false);
+    }
+    assert(previous == 40);
+    if (!am.fetchOr(Key(1), &Value::v, 1, &previous)) {
+      assert(false);
+    }
+    assert(previous == 40);
+    int expected = 40;
+    if (am.compareExchange(Key(1), &Value::v, expected, 7)) {
+      assert(false);
+    }
+    assert(expected == 41);
+    if (!am.compareExchange(Key(1), &Value::v, expected, 7)) {
+      assert(false);
+    }
+    for (int i = 2; i <= 300; ++i) {
+      Value v;
+      if (!am.lookupCopy(Key(i), &v)) {
+        assert(false);
+      }
+      assert(v.v == 40);
+    }
+    if (am.fetchAdd(Key(-1), &Value::v, 1)) {
+      assert(false);
+    }
+  };
+  auto transparent = [&]() {
+    CuckooMap<Key, Value, IntKeyHash<1>, IntKeyHash<2>, IntKeyEqual> tm(16);
+    for (int i = 1; i < 200; ++i) {
+      Value v(i);
+      if (!tm.insert(Key(i), &v)) {
+        assert(false);
+      }
+    }
+    for (int i = 1; i < 200; ++i) {
+      auto f = tm.lookup(i);
+      assert(f.found() == 1 && f.value()->v == i);
+    }
+    Value copy;
+    if (!tm.lookupCopy(42, &copy)) {
+      assert(false);
+    }
+    assert(copy.v == 42);
+    if (!tm.update(42, [](Value* v) { v->v = -42; })) {
+      assert(false);
+    }
+    int seen = 0;
+    if (!tm.visit(42, [&seen](Value const* v) { seen = v->v; })) {
+      assert(false);
+    }
+    assert(seen == -42);
+    for (int i = 1; i < 200; i += 2) {
+      if (!tm.remove(i)) {
+        assert(false);
+      }
+    }
+    if (tm.remove(1)) {
+      assert(false);
+    }
+    assert(tm.nrUsed() == 99);
+    for (int i = 1; i < 200; ++i) {
+      auto f = tm.lookup(Key(i));
+      assert(f.found() == (i % 2 == 0 ? 1 : 0));
+    }
+  };
+  auto moveOnly = [&]() {
+    CuckooMap<OwnedKey, Value, OwnedKeyHash<1>, OwnedKeyHash<2>,
+              OwnedKeyEqual>
+        om(16);
+    for (int i = 1; i < 1000; ++i) {
+      Value v(i);
+      bool inserted =
+          (i % 2 == 0) ? om.insert(OwnedKey(i), &v) : om.emplace(&v, i);
+      if (!inserted) {
+        assert(false);
+      }
+    }
+    assert(om.nrLayers() > 1);
+    // Lookups promote pairs from later layers by moving their keys, the
+    // Finding must point to the promoted pair:
+    for (int i = 999; i >= 1; --i) {
+      auto f = om.lookup(OwnedKey(i));
+      assert(f.found() == 1 && *f.key()->p == i && f.value()->v == i);
+    }
+    for (int i = 1; i < 1000; i += 2) {
+      if (!om.remove(OwnedKey(i))) {
+        assert(false);
+      }
+    }
+    assert(om.nrUsed() == 499);
+    for (int i = 1; i < 1000; ++i) {
+      auto f = om.lookup(OwnedKey(i));
+      assert(f.found() == (i % 2 == 0 ? 1 : 0));
+    }
+  };
+  auto coroutines = [&]() {
+#if CUCKOO_MAP_COROUTINES
+    CuckooMap<Key, Value> cm(16);
+    for (int i = 1; i < 2000; ++i) {
+      Value v(i);
+      cm.insert(Key(i), &v);
+    }
+    assert(cm.nrLayers() > 2);
+    std::vector<Key> keys;
+    for (int i = 1; i < 4000; i += 3) {
+      keys.push_back(Key(i));
+    }
+    std::vector<Value> values(keys.size());
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    size_t hits = interleavedLookups(cm, keys.data(), keys.size(),
+                                     values.data(), found.get(), 8);
+    size_t expected = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      bool in = keys[i].k < 2000;
+      expected += in ? 1 : 0;
+      assert(found[i] == in && (!in || values[i].v == keys[i].k));
+    }
+    assert(hits == expected);
+    // A single lookup, driven by hand:
+    Value v;
+    CuckooLookupTask task = cm.co_lookup(Key(1999), &v);
+    while (!task.done()) {
+      task.resume();
+    }
+    assert(task.found() && v.v == 1999);
+#endif
+  };
+  auto hashPolicies = [&]() {
+    checkHashPolicies<Crc32cHash<Key, 1>, AesHash<Key, 2>>();
+    checkHashPolicies<WyHash<Key, 1>, MultiplyShiftHash<Key, 2>>();
+    checkHashPolicies<DispatchHash<Key, 1>, DispatchHash<Key, 2>>();
+    checkHashPolicies<WyHash<Key, 1>, SingleHash>();
+    checkHashPolicies<HashWithSeed<Key, 1>, SingleHash>();
+  };
+  auto batch = [&]() {
+    std::vector<Key> keys;
+    std::vector<WideKey> wideKeys;
+    for (int i = 1; i < 38; ++i) {
+      keys.push_back(Key(i * 7919));
+      WideKey w = {{uint32_t(i), uint32_t(i * 3), 0, uint32_t(-i), 42}};
+      wideKeys.push_back(w);
+    }
+    checkBatchKernels(keys);
+    checkBatchKernels(wideKeys);
+    typedef BatchHash<Key, 0x1234> Hash;
+    CuckooMap<Key, Value, SplitHash1<Hash>, SplitHash2<Hash>> split(16);
+    checkLookupCopyBatch(split);
+    CuckooMap<Key, Value, BatchHash<Key, 1>, SingleHash> single(16);
+    checkLookupCopyBatch(single);
+    CuckooMap<Key, Value> plain(16);  // hashed one by one
+    checkLookupCopyBatch(plain);
+  };
+  auto storedTags = [&]() {
+    // Every insert hashes its key once, and the pairs it expunges on the
+    // way through the cascade come with their stored hashes:
+    typedef CountingHash<1> Hash1;
+    typedef CountingHash<2> Hash2;
+    CuckooMap<Key, Value, Hash1, Hash2, std::equal_to<Key>, 2, true> tagged(
+        16);
+    uint64_t calls = hashCallsOfInserts(tagged, 5000);
+    assert(calls == 4999 && tagged.nrLayers() > 1);
+#if CUCKOO_MAP_STATISTICS
+    assert(tagged.stats().evictions > 0);
+#endif
+    CuckooMap<Key, Value, Hash1, SingleHash, std::equal_to<Key>, 2, true>
+        single(16);
+    calls = hashCallsOfInserts(single, 5000);
+    assert(calls == 4999);
+    // Without tags expunged pairs are hashed again:
+    CuckooMap<Key, Value, Hash1, Hash2> untagged(16);
+    calls = hashCallsOfInserts(untagged, 5000);
+    assert(calls > 4999);
+    (void)calls;
+  };
+  auto flooding = [&]() {
+    // With fixed seeds every layer has room for just a few of the colliding
+    // keys, so the cascade grows a layer every few inserts:
+    typedef CuckooMap<Key, Value, WeakHash<0>, WeakHash<~0ULL>> WeakMap;
+    CuckooMapPolicy fixed;
+    fixed.rehashBelowLoad = 0;
+    WeakMap tall(16, sizeof(Value), alignof(Value), fixed);
+    insertAndFind(tall, 1, 25);
+    assert(tall.nrLayers() >= 5);
+    // Flooded layers are rehashed with random seeds, and the cascade
+    // stays about as short as with a good hash:
+    CuckooMap<Key, Value> good(16);
+    insertAndFind(good, 1, 20000);
+    WeakMap rehashed(16);
+    insertAndFind(rehashed, 1, 20000);
+    std::cout << "flooded: " << rehashed.stats() << std::flush;
+    assert(rehashed.nrLayers() <= good.nrLayers() + 1);
+    CuckooMapPolicy seeded;
+    seeded.randomSeeds = true;
+    WeakMap random(16, sizeof(Value), alignof(Value), seeded);
+    insertAndFind(random, 1, 20000);
+    assert(random.nrLayers() <= good.nrLayers() + 1);
+    CuckooMap<Key, Value, WeakHash<0>, SingleHash> single(
+        16, sizeof(Value), alignof(Value), seeded);
+    insertAndFind(single, 1, 20000);
+#if CUCKOO_MAP_STATISTICS
+    assert(rehashed.stats().rehashes > 0);
+    assert(random.stats().rehashes == 0);
+#endif
+    // Rehashes take the mutex, concurrent lock-free readers retry:
+    WeakMap shared(16);
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> wrong(0);
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&shared, &wrong, t]() {
+        int base = t * 10000 + 1;
+        for (int i = 0; i < 5000; ++i) {
+          Value v(base + i);
+          if (!shared.insert(Key(base + i), &v)) {
+            wrong.fetch_add(1);
+          }
+          if (!shared.lookupCopy(Key(base + i / 2), &v) ||
+              v.v != base + i / 2) {
+            wrong.fetch_add(1);
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    assert(wrong.load() == 0);
+    assert(shared.nrUsed() == 4 * 5000);
+    assert(shared.nrLayers() <= good.nrLayers() + 1);
+  };
+  auto layerLimit = [&]() {
+    checkLayerLimit<CuckooMap<Key, Value, ConstantHash, ConstantHash>>();
+    checkLayerLimit<CuckooMap<Key, Value, ConstantHash, ConstantHash,
+                              std::equal_to<Key>, 2, true>>();
+  };
+  auto writers = [&]() {
+    // Writers on disjoint keys only lock buckets and run concurrently,
+    // mixed with Findings, which exclude them:
+    CuckooMap<Key, Value> wm(16);
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> wrong(0);
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&wm, &wrong, t]() {
+        int base = (t + 1) * 100000;
+        for (int round = 0; round < 5; ++round) {
+          for (int i = 0; i < 2000; ++i) {
+            Value v(base + i);
+            if (!wm.insert(Key(base + i), &v)) {
+              wrong.fetch_add(1);
+            }
+          }
+          for (int i = 0; i < 2000; ++i) {
+            Value v;
+            if (!wm.lookupCopy(Key(base + i), &v) || v.v != base + i) {
+              wrong.fetch_add(1);
+            }
+            if (i % 7 == 0) {
+              auto f = wm.lookup(Key(base + i));
+              if (!f.found() || f.value()->v != base + i) {
+                wrong.fetch_add(1);
+              }
+            }
+          }
+          for (int i = round == 4 ? 1000 : 0; i < 2000; ++i) {
+            if (!wm.remove(Key(base + i))) {
+              wrong.fetch_add(1);
+            }
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    std::cout << "concurrent writers: " << wrong.load() << " wrong, "
+              << wm.stats() << std::flush;
+    assert(wrong.load() == 0);
+    assert(wm.nrUsed() == 4 * 1000);
+    assert(wm.stats().nrUsed == 4 * 1000);
+  };
   std::cout << "map was made" << std::endl;
   insert();
   show();
   remove();
   show();
+  visit();
+  m.prefetch(Key(1));  // a hint only, neither changes nor counts
+  m.prefetch(Key(12345));
+  stats();
+  policy();
+  optimistic();
+  readModifyWrite();
+  atomics();
+  transparent();
+  moveOnly();
+  coroutines();
+  hashPolicies();
+  batch();
+  storedTags();
+  flooding();
+  layerLimit();
+  writers();
 }
@@ -67,9 +67,62 @@ int main(int argc, char* argv[]) {
       }
     }
   };
+  auto visit = [&]() {
+    int sum = 0;
+    auto add = [&sum](Value const* v) { sum += v->v; };
+    if (!m.visit(Key(5), add)) {
+      assert(false);
+    }
+    assert(sum == 500);
+    m.update(Key(5), [](Value* v) { v->v += 100; });
+    sum = 0;
+    m.visit(Key(5), add);
+    assert(sum == 1500);
+    m.update(Key(5), [](Value* v) { v->v -= 100; });
+    assert(!m.visit(Key(1), add));
+  };
+  auto readModifyWrite = [&]() {
+    Value v(11);
+    if (!m.insertOrAssign(Key(11), &v) || m.tryEmplace(Key(11), 21)) {
+      assert(false);
+    }
+    if (m.upsert(Key(11), &v,
+                 [](Value* a, Value const* b) { a->v += b->v; })) {
+      assert(false);
+    }
+    int sum = 0;
+    m.visit(Key(11), [&sum](Value const* w) { sum += w->v; });
+    assert(sum == 22);
+    if (!m.computeIfAbsent(Key(12), [](Value* w) { w->v = 12; })) {
+      assert(false);
+    }
+    if (!m.remove(Key(11)) || !m.remove(Key(12))) {
+      assert(false);
+    }
+  };
+  auto singleHash = [&]() {
+    CuckooMultiMap<Key, Value, HashWithSeed<Key, 1>, SingleHash> s(16);
+    for (int x = 1; x < 300; ++x) {
+      for (int y = 0; y < 3; ++y) {
+        Value v(x);
+        if (!s.insert(Key(x), &v)) {
+          assert(false);
+        }
+      }
+    }
+    for (int x = 1; x < 300; ++x) {
+      int sum = 0;
+      s.visit(Key(x), [&sum](Value const* w) { sum += w->v; });
+      assert(sum == 3 * x);
+    }
+  };
   std::cout << "map was made" << std::endl;
   insert();
   show();
   remove();
   show();
+  visit();
+  readModifyWrite();
+  show();
+  singleHash();
 }
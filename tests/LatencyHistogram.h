@@ -0,0 +1,97 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H 1
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// A log-bucketed latency histogram in the spirit of HdrHistogram. Values
+// (nanoseconds) below 2^SubBucketBits are recorded exactly, above that
+// every power of two range is split into 2^SubBucketBits linear
+// sub-buckets, which bounds the relative error of a reported percentile
+// by 2^-SubBucketBits (about 3%). Recording is a few instructions and never
+// allocates, histograms of different threads can be merged afterwards.
+
+class LatencyHistogram {
+  static constexpr unsigned SubBucketBits = 5;
+  static constexpr uint64_t SubBucketMask = (1ULL << SubBucketBits) - 1;
+  static constexpr unsigned NrBuckets = (65 - SubBucketBits) << SubBucketBits;
+
+ public:
+  LatencyHistogram() : _counts(NrBuckets, 0), _total(0), _max(0) {}
+
+  void record(uint64_t value) {
+    ++_counts[index(value)];
+    ++_total;
+    if (value > _max) {
+      _max = value;
+    }
+  }
+
+  void merge(LatencyHistogram const& other) {
+    for (unsigned i = 0; i < NrBuckets; ++i) {
+      _counts[i] += other._counts[i];
+    }
+    _total += other._total;
+    if (other._max > _max) {
+      _max = other._max;
+    }
+  }
+
+  uint64_t count() const { return _total; }
+
+  uint64_t max() const { return _max; }
+
+  // Returns the smallest recorded value v (up to bucket precision) such
+  // that a fraction q of all recorded values is <= v, q in [0, 1].
+  uint64_t percentile(double q) const {
+    if (_total == 0) {
+      return 0;
+    }
+    uint64_t target = static_cast<uint64_t>(q * _total + 0.5);
+    if (target == 0) {
+      target = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < NrBuckets; ++i) {
+      seen += _counts[i];
+      if (seen >= target) {
+        uint64_t upper = highestInBucket(i);
+        return upper < _max ? upper : _max;
+      }
+    }
+    return _max;
+  }
+
+ private:
+  static unsigned index(uint64_t value) {
+    if (value <= SubBucketMask) {
+      return static_cast<unsigned>(value);
+    }
+    unsigned shift = 63 - __builtin_clzll(value) - SubBucketBits;
+    return static_cast<unsigned>(((shift + 1) << SubBucketBits) +
+                                 ((value >> shift) & SubBucketMask));
+  }
+
+  static uint64_t highestInBucket(unsigned i) {
+    if (i <= SubBucketMask) {
+      return i;
+    }
+    unsigned shift = (i >> SubBucketBits) - 1;
+    uint64_t lowest = ((SubBucketMask + 1) | (i & SubBucketMask)) << shift;
+    return lowest + (1ULL << shift) - 1;
+  }
+
+  std::vector<uint64_t> _counts;
+  uint64_t _total;
+  uint64_t _max;
+};
+
+// Monotonic clock in nanoseconds, for use with LatencyHistogram::record:
+inline uint64_t latencyClock() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+#endif
@@ -1,40 +1,70 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <cuckoomap/CuckooHelpers.h>
 #include <cuckoomap/CuckooMap.h>
+#include <cuckoomap/ShardedMap.h>
+
+#include "../benchmarks/PerfCounters.h"
+#include "LatencyHistogram.h"
+#include "WorkloadGenerators.h"
 
 #define MIN(a, b) (((a) <= (b)) ? (a) : (b))
 
-#define KEY_PAD 4
-#define VALUE_PAD 4
+// Key and value sizes in bytes which are compiled in, see dispatch():
+static unsigned const keySizes[] = {4, 8, 16, 32, 64};
+static unsigned const valueSizes[] = {0, 4, 8, 16, 32, 64, 128, 256};
+static constexpr unsigned MaxValueSize = 256;
+
+template <unsigned Size>
+struct Padding {
+  char padding[Size];
+  Padding() { std::memset(padding, 0, Size); }
+};
+
+template <>
+struct Padding<0> {};
 
-struct Key {
-  int k;
-  static constexpr char padding[KEY_PAD] = {0};
+// A key of Size bytes: the key number followed by zero bytes, which are
+// hashed along with it.
+template <unsigned Size>
+struct Key : Padding<Size - sizeof(uint32_t)> {
+  uint32_t k;
   Key() : k(0) {}
-  Key(int i) : k(i) {}
+  Key(uint32_t i) : k(i) {}
   bool empty() { return k == 0; }
 };
 
-struct Value {
-  int v;
-  static constexpr char padding[VALUE_PAD] = {0};
-  Value() : v(0) {}
-  Value(int i) : v(i) {}
-  bool empty() { return v == 0; }
+// A value of Size bytes, the first (up to) four of which hold a number:
+template <unsigned Size>
+struct Value : Padding<Size> {
+  Value() {}
+  Value(uint32_t i) {
+    std::memcpy(static_cast<void*>(this), &i, MIN(Size, sizeof(i)));
+  }
 };
 
 namespace std {
-template <>
-struct equal_to<Key> {
-  bool operator()(Key const& a, Key const& b) const { return a.k == b.k; }
+template <unsigned Size>
+struct equal_to<Key<Size>> {
+  bool operator()(Key<Size> const& a, Key<Size> const& b) const {
+    return a.k == b.k;
+  }
 };
 }
 
@@ -81,36 +111,94 @@ class WeightedSelector {
   }
 };
 
-typedef HashWithSeed<Key, 0xdeadbeefdeadbeefULL> KeyHash;
-typedef std::unordered_map<Key, Value*, KeyHash> unordered_map;
+// Releases all waiting threads at once as soon as the expected number
+// of threads has arrived. Used to start the timed phase of all workers
+// simultaneously.
+class Barrier {
+ private:
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  unsigned _expected;
+  unsigned _arrived;
+
+ public:
+  Barrier(unsigned expected) : _expected(expected), _arrived(0) {}
+  void wait() {
+    std::unique_lock<std::mutex> guard(_mutex);
+    if (++_arrived == _expected) {
+      _cond.notify_all();
+    } else {
+      _cond.wait(guard, [this]() { return _arrived >= _expected; });
+    }
+  }
+};
 
+// Thread-safe wrapper around either a sharded CuckooMap or a
+// std::unordered_map protected by a single mutex (the baseline). The
+// CuckooMap is instantiated once per key size only and gets the value size
+// at runtime, std::unordered_map needs a type per value size.
+template <unsigned KeySize, unsigned ValueSize>
 class TestMap {
+ public:
+  typedef ::Key<KeySize> Key;
+  typedef ::Value<ValueSize> Value;
+  static constexpr unsigned keySize = KeySize;
+  static constexpr unsigned valueSize = ValueSize;
+
  private:
+  typedef HashWithSeed<Key, 0xdeadbeefdeadbeefULL> KeyHash;
+  typedef std::unordered_map<Key, Value, KeyHash> unordered_map;
+  typedef ::Value<MaxValueSize> MaxValue;
+  typedef ShardedMap<CuckooMap<Key, MaxValue>> sharded_map;
+
   int _useCuckoo;
-  std::unique_ptr<CuckooMap<Key, Value>> _cuckoo;
+  bool _optimistic;
+  std::unique_ptr<sharded_map> _cuckoo;
   std::unique_ptr<unordered_map> _unordered;
+  std::mutex _mutex;
 
  public:
-  TestMap(int useCuckoo, size_t initialSize) : _useCuckoo(useCuckoo) {
+  TestMap(int useCuckoo, size_t initialSize, uint32_t nrShards,
+          bool optimistic)
+      : _useCuckoo(useCuckoo), _optimistic(optimistic) {
     if (_useCuckoo) {
-      _cuckoo.reset(new CuckooMap<Key, Value>(initialSize));
+      size_t perShard = initialSize / (nrShards == 0 ? 1 : nrShards);
+      _cuckoo.reset(
+          new sharded_map(perShard, nrShards, ValueSize, alignof(Value)));
     } else {
       _unordered.reset(new unordered_map(initialSize));
     }
   }
-  Value* lookup(Key const& k) {
-    if (_useCuckoo) {
+  bool lookup(Key const& k, Value& v) {
+    if (_useCuckoo && _optimistic) {
+      MaxValue copy;
+      if (!_cuckoo->lookupCopy(k, &copy)) {
+        return false;
+      }
+      std::memcpy(static_cast<void*>(&v), &copy, ValueSize);
+      return true;
+    } else if (_useCuckoo) {
       auto element = _cuckoo->lookup(k);
-      return (element.found() ? element.value() : nullptr);
+      if (element.found()) {
+        std::memcpy(static_cast<void*>(&v), element.value(), ValueSize);
+        return true;
+      }
+      return false;
     } else {
+      std::lock_guard<std::mutex> guard(_mutex);
       auto element = _unordered->find(k);
-      return (element != _unordered->end()) ? (*element).second : nullptr;
+      if (element != _unordered->end()) {
+        v = (*element).second;
+        return true;
+      }
+      return false;
     }
   }
-  bool insert(Key const& k, Value* v) {
+  bool insert(Key const& k, Value const& v) {
     if (_useCuckoo) {
-      return _cuckoo->insert(k, v);
+      return _cuckoo->insert(k, reinterpret_cast<MaxValue const*>(&v));
     } else {
+      std::lock_guard<std::mutex> guard(_mutex);
       return _unordered->emplace(k, v).second;
     }
   }
@@ -118,153 +206,836 @@ class TestMap {
     if (_useCuckoo) {
       return _cuckoo->remove(k);
     } else {
+      std::lock_guard<std::mutex> guard(_mutex);
       return (_unordered->erase(k) > 0);
     }
   }
+  ShardedMapStats stats() {
+    return _useCuckoo ? _cuckoo->stats() : ShardedMapStats();
+  }
+};
+
+enum OpType { OpInsert = 0, OpLookupHit, OpLookupMiss, OpRemove, NrOpTypes };
+
+static char const* opTypeNames[NrOpTypes] = {"insert", "lookup_hit",
+                                             "lookup_miss", "remove"};
+
+// Distribution of the keys of lookups which are not deliberate misses:
+enum Distribution {
+  DistUniform = 0,  // uniform hot set (nWorking, pWorking) and cold rest
+  DistZipfian,      // scrambled Zipfian over the live keys
+  DistHotspot,      // hot set as DistUniform, moving every shiftInterval ops
+  DistScan,         // sequential scan over the live keys
+  DistLatest,       // Zipfian, most recently inserted keys most popular
+  NrDistributions
+};
+
+static char const* distributionNames[NrDistributions] = {
+    "uniform", "zipfian", "hotspot", "scan", "latest"};
+
+struct Workload {
+  bool latency;  // record a latency histogram per operation type
+  bool stats;    // print the map statistics after every run
+  bool perf;     // count hardware events in every worker thread
+  bool optimistic;  // lock-free lookups in the CuckooMap
+  unsigned nOpCount;
+  unsigned nMaxSize;
+  unsigned nWorking;
+  double pInsert;
+  double pLookup;
+  double pRemove;
+  double pWorking;
+  double pMiss;
+  unsigned seed;
+  Distribution distribution;
+  double theta;                            // for DistZipfian and DistLatest
+  unsigned shiftInterval;                  // for DistHotspot
+  std::vector<TraceRecord> const* replay;  // replay this instead, if set
+};
+
+// One worker thread. Every worker owns a disjoint key range
+// [_base, _base + _stride) and its own PRNGs, so the threads do not
+// interfere logically and inserts and removes never fail because of other
+// threads. Misses are drawn from the nMaxSize keys above the largest key
+// ever inserted.
+template <class TestMap>
+class Worker {
+ private:
+  typedef typename TestMap::Key Key;
+  typedef typename TestMap::Value Value;
+
+  Workload const& _w;
+  TestMap& _map;
+  unsigned _base;
+  unsigned _stride;
+  RandomNumber _r;
+  WeightedSelector _operations;
+  WeightedSelector _working;
+  WeightedSelector _miss;
+  ZipfianGenerator _zipf;
+  unsigned _hotStart;   // offset of the hot set for DistHotspot
+  unsigned _cursor;     // position of the scan for DistScan
+  uint64_t _opsDone;
+  std::vector<TraceRecord>* _record;
+  LatencyHistogram _histograms[NrOpTypes];
+
+  uint64_t startClock() { return _w.latency ? latencyClock() : 0; }
+
+  void stopClock(uint64_t start, OpType op) {
+    if (_w.latency) {
+      _histograms[op].record(latencyClock() - start);
+    }
+  }
+
+  static std::vector<double> weights(double a, double b) {
+    std::vector<double> w;
+    w.push_back(a);
+    w.push_back(b);
+    return w;
+  }
+
+  static std::vector<double> weights(double a, double b, double c) {
+    std::vector<double> w = weights(a, b);
+    w.push_back(c);
+    return w;
+  }
+
+  double uniform() { return _r.next() / 2147483647.0; }
+
+  // Zipfian rank over the fixed domain [0, nMaxSize), scattered over that
+  // domain and folded into the current number n of live keys, such that
+  // the identity of the popular keys is stable once the map is filled:
+  unsigned zipfianOffset(unsigned n) {
+    uint64_t rank = _zipf.next(_w.nMaxSize, uniform());
+    return static_cast<unsigned>(scrambleRank(rank) % _w.nMaxSize) % n;
+  }
+
+  unsigned chooseLookup(unsigned minElement, unsigned maxElement,
+                        unsigned i) {
+    unsigned n = maxElement - minElement;
+    unsigned barrier, nHot, nCold;
+    if (_miss.next()) {
+      return maxElement + _r.nextInRange(_w.nMaxSize);
+    }
+    if (n == 0) {
+      return minElement;
+    }
+    switch (_w.distribution) {
+      case DistZipfian:
+        return minElement + zipfianOffset(n);
+      case DistHotspot:
+        if (i % _w.shiftInterval == 0) {
+          _hotStart = _r.nextInRange(_w.nMaxSize);
+        }
+        if (_working.next()) {
+          return minElement +
+                 (_hotStart + _r.nextInRange(MIN(_w.nWorking, n))) % n;
+        }
+        return minElement + _r.nextInRange(n);
+      case DistScan:
+        return minElement + (_cursor++ % n);
+      case DistLatest:
+        return maxElement - 1 - _zipf.next(n, uniform());
+      default:
+        barrier = MIN(minElement + _w.nWorking, maxElement);
+        nHot = barrier - minElement;
+        nCold = maxElement - barrier;
+        if (_working.next()) {
+          return minElement + _r.nextInRange(nHot);
+        }
+        return nCold ? barrier + _r.nextInRange(nCold)
+                     : minElement + _r.nextInRange(nHot);
+    }
+  }
+
+  bool doInsert(unsigned current) {
+    uint64_t start = startClock();
+    bool success = _map.insert(Key(_base + current), Value(_base + current));
+    stopClock(start, OpInsert);
+    return success;
+  }
+
+  bool doLookup(unsigned current) {
+    Value v;
+    uint64_t start = startClock();
+    bool success = _map.lookup(Key(_base + current), v);
+    stopClock(start, success ? OpLookupHit : OpLookupMiss);
+    return success;
+  }
+
+  bool doRemove(unsigned current) {
+    uint64_t start = startClock();
+    bool success = _map.remove(Key(_base + current));
+    stopClock(start, OpRemove);
+    return success;
+  }
+
+  void record(uint32_t op, unsigned current) {
+    if (_record != nullptr) {
+      TraceRecord r;
+      r.op = op;
+      r.key = current;
+      _record->push_back(r);
+    }
+  }
+
+ public:
+  Worker(Workload const& w, TestMap& map, unsigned threadIndex,
+         unsigned nThreads, std::vector<TraceRecord>* record)
+      : _w(w),
+        _map(map),
+        // Key 0 is the empty key, so all ranges start at 1:
+        _stride(0x7ffffffeu / nThreads),
+        _r(w.seed + 7919 * threadIndex),
+        _operations(w.seed + 7919 * threadIndex,
+                    weights(w.pInsert, w.pLookup, w.pRemove)),
+        _working(w.seed + 7919 * threadIndex,
+                 weights(1.0 - w.pWorking, w.pWorking)),
+        _miss(w.seed + 7919 * threadIndex, weights(1.0 - w.pMiss, w.pMiss)),
+        _zipf(w.theta),
+        _hotStart(0),
+        _cursor(0),
+        _opsDone(0),
+        _record(record) {
+    _base = 1 + threadIndex * _stride;
+  }
+
+  LatencyHistogram const& histogram(OpType op) const {
+    return _histograms[op];
+  }
+
+  uint64_t opsDone() const { return _opsDone; }
+
+  void run() {
+    if (_w.replay != nullptr) {
+      replay(*_w.replay);
+      return;
+    }
+    unsigned minElement = 0;
+    unsigned maxElement = 0;
+    unsigned current;
+    for (unsigned i = 0; i < _w.nOpCount; i++) {
+      switch (_operations.next()) {
+        case 0:
+          // insert if allowed
+          if (maxElement - minElement >= _w.nMaxSize) {
+            break;
+          }
+          current = maxElement++;
+          record(0, current);
+          if (!doInsert(current)) {
+            std::cout << "Failed to insert " << _base + current << std::endl;
+            exit(-1);
+          }
+          break;
+        case 1:
+          // lookup
+          current = chooseLookup(minElement, maxElement, i);
+          record(1, current);
+          doLookup(current);
+          break;
+        case 2:
+          // remove if allowed
+          if (minElement >= maxElement) {
+            break;
+          }
+          current = _working.next() ? minElement++ : --maxElement;
+          record(2, current);
+          if (!doRemove(current)) {
+            std::cout << "Failed to remove " << _base + current << std::endl;
+            exit(-1);
+          }
+          break;
+        default:
+          break;
+      }
+    }
+    _opsDone = _w.nOpCount;
+  }
+
+  // Replays a recorded trace once. Unlike the generated workload, a trace
+  // may contain inserts of present keys and removes of missing ones, so
+  // failures are not treated as errors here.
+  void replay(std::vector<TraceRecord> const& trace) {
+    for (TraceRecord const& r : trace) {
+      switch (r.op) {
+        case 0:
+          doInsert(r.key);
+          break;
+        case 1:
+          doLookup(r.key);
+          break;
+        default:
+          doRemove(r.key);
+          break;
+      }
+    }
+    _opsDone = trace.size();
+  }
 };
 
-// Usage: PerformanceTest [cuckoo] [nInitial] [nTotal] [nWorking] [pInsert]
-//          [pLookup] [pRemove] [pWorking] [pMiss] [seed]
-//    [cuckoo]: 1 = use CuckooMap; 0 = Use std::unordered_map
-//    [nOpCount]: Number of operations to run
+struct RunResult {
+  std::string map;
+  unsigned keySize;
+  unsigned valueSize;
+  unsigned threads;
+  double opsPerSecond;
+  double efficiency;
+  LatencyHistogram histograms[NrOpTypes];  // merged over all threads
+  ShardedMapStats stats;                   // only with --stats
+  bool perfAvailable[PerfCounters::NrEvents];  // only with --perf
+  double perfPerOp[PerfCounters::NrEvents];    // summed over all threads
+};
+
+// Runs the workload with nThreads threads, each performing nOpCount
+// operations (or replaying the trace), and stores the aggregate throughput
+// in operations per second in result. The clock runs from the moment the
+// barrier releases all threads until the last one has finished. If record
+// is set, the operations of the first thread are appended to it. With
+// w.perf, every thread counts hardware events around its run() only, the
+// sums are reported per operation. Counting per operation type would
+// need two system calls around every operation, far more than most
+// operations cost.
+template <class TestMap>
+void runTimed(Workload const& w, int useCuckoo, unsigned nInitialSize,
+              uint32_t nShards, unsigned nThreads, RunResult& result,
+              std::vector<TraceRecord>* record) {
+  TestMap map(useCuckoo, nInitialSize, nShards, w.optimistic);
+  std::vector<std::unique_ptr<Worker<TestMap>>> workers;
+  for (unsigned t = 0; t < nThreads; ++t) {
+    workers.emplace_back(
+        new Worker<TestMap>(w, map, t, nThreads, t == 0 ? record : nullptr));
+  }
+
+  Barrier start(nThreads + 1);
+  Barrier stop(nThreads + 1);
+  std::vector<std::thread> threads;
+  std::mutex perfMutex;
+  uint64_t perfTotals[PerfCounters::NrEvents] = {0};
+  for (int e = 0; e < PerfCounters::NrEvents; ++e) {
+    result.perfAvailable[e] = w.perf;
+  }
+  for (unsigned t = 0; t < nThreads; ++t) {
+    Worker<TestMap>* worker = workers[t].get();
+    threads.emplace_back([worker, &w, &start, &stop, &perfMutex,
+                          &perfTotals, &result]() {
+      // The counters count the calling thread, so they are opened here:
+      std::unique_ptr<PerfCounters> counters;
+      if (w.perf) {
+        counters.reset(new PerfCounters());
+      }
+      start.wait();
+      if (counters) {
+        counters->start();
+      }
+      worker->run();
+      if (counters) {
+        counters->stop();
+      }
+      stop.wait();
+      if (counters) {
+        std::lock_guard<std::mutex> guard(perfMutex);
+        counters->read(perfTotals);
+        for (int e = 0; e < PerfCounters::NrEvents; ++e) {
+          if (!counters->available(static_cast<PerfCounters::Event>(e))) {
+            result.perfAvailable[e] = false;
+          }
+        }
+      }
+    });
+  }
+
+  start.wait();
+  auto begin = std::chrono::steady_clock::now();
+  stop.wait();
+  auto end = std::chrono::steady_clock::now();
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (w.stats) {
+    result.stats = map.stats();
+  }
+
+  double seconds = std::chrono::duration<double>(end - begin).count();
+  result.map = useCuckoo ? "cuckoo" : "unordered";
+  result.keySize = TestMap::keySize;
+  result.valueSize = TestMap::valueSize;
+  result.threads = nThreads;
+  uint64_t ops = 0;
+  for (auto& worker : workers) {
+    ops += worker->opsDone();
+  }
+  result.opsPerSecond = static_cast<double>(ops) / seconds;
+  for (int e = 0; e < PerfCounters::NrEvents; ++e) {
+    result.perfPerOp[e] =
+        ops == 0 ? 0.0 : static_cast<double>(perfTotals[e]) / ops;
+  }
+  for (auto& worker : workers) {
+    for (int op = 0; op < NrOpTypes; ++op) {
+      result.histograms[op].merge(worker->histogram(static_cast<OpType>(op)));
+    }
+  }
+}
+
+void printStats(ShardedMapStats const& s) {
+  std::cout << s.total;
+  for (size_t shard = 0; s.shards.size() > 1 && shard < s.shards.size();
+       ++shard) {
+    std::cout << "  shard " << shard << ": " << s.shards[shard].lookups
+              << " lookups, " << s.shards[shard].inserts << " inserts, "
+              << s.shards[shard].removes << " removes" << std::endl;
+  }
+}
+
+void printLatencies(RunResult const& r) {
+  std::cout << "  " << std::left << std::setw(13) << "operation"
+            << std::right << std::setw(12) << "count" << std::setw(10)
+            << "p50[ns]" << std::setw(10) << "p99[ns]" << std::setw(10)
+            << "p99.9[ns]" << std::setw(12) << "max[ns]" << std::endl;
+  for (int op = 0; op < NrOpTypes; ++op) {
+    LatencyHistogram const& h = r.histograms[op];
+    std::cout << "  " << std::left << std::setw(13) << opTypeNames[op]
+              << std::right << std::setw(12) << h.count() << std::setw(10)
+              << h.percentile(0.5) << std::setw(10) << h.percentile(0.99)
+              << std::setw(10) << h.percentile(0.999) << std::setw(12)
+              << h.max() << std::endl;
+  }
+}
+
+void printPerf(RunResult const& r) {
+  std::cout << "  per op:";
+  for (int e = 0; e < PerfCounters::NrEvents; ++e) {
+    std::cout << ' ' << PerfCounters::name(e) << ' ';
+    if (r.perfAvailable[e]) {
+      std::cout << std::fixed << std::setprecision(2) << r.perfPerOp[e];
+    } else {
+      std::cout << "n/a";
+    }
+  }
+  std::cout << std::endl;
+}
+
+// Hardware counters per operation are the same in all rows of a run, they
+// are empty if not counted:
+void writeCsv(std::string const& path, std::vector<RunResult> const& results) {
+  std::ofstream out(path);
+  out << "map,key_size,value_size,threads,ops_per_sec,efficiency,operation,"
+         "count,p50_ns,p99_ns,p999_ns,max_ns";
+  for (int e = 0; e < PerfCounters::NrEvents; ++e) {
+    out << ',' << PerfCounters::name(e) << "_per_op";
+  }
+  out << '\n';
+  for (auto const& r : results) {
+    for (int op = 0; op < NrOpTypes; ++op) {
+      LatencyHistogram const& h = r.histograms[op];
+      out << r.map << ',' << r.keySize << ',' << r.valueSize << ','
+          << r.threads << ',' << std::fixed
+          << std::setprecision(0) << r.opsPerSecond << ','
+          << std::setprecision(3) << r.efficiency << ',' << opTypeNames[op]
+          << ',' << h.count() << ',' << h.percentile(0.5) << ','
+          << h.percentile(0.99) << ',' << h.percentile(0.999) << ','
+          << h.max();
+      for (int e = 0; e < PerfCounters::NrEvents; ++e) {
+        out << ',';
+        if (r.perfAvailable[e]) {
+          out << r.perfPerOp[e];
+        }
+      }
+      out << '\n';
+    }
+  }
+}
+
+void writeJson(std::string const& path,
+               std::vector<RunResult> const& results) {
+  std::ofstream out(path);
+  out << "[";
+  for (size_t i = 0; i < results.size(); ++i) {
+    RunResult const& r = results[i];
+    out << (i == 0 ? "\n" : ",\n") << "  {\"map\": \"" << r.map
+        << "\", \"key_size\": " << r.keySize
+        << ", \"value_size\": " << r.valueSize
+        << ", \"threads\": " << r.threads << ", \"ops_per_sec\": "
+        << std::fixed << std::setprecision(0) << r.opsPerSecond
+        << ", \"efficiency\": " << std::setprecision(3) << r.efficiency
+        << ", \"latency_ns\": {";
+    for (int op = 0; op < NrOpTypes; ++op) {
+      LatencyHistogram const& h = r.histograms[op];
+      out << (op == 0 ? "" : ", ") << "\"" << opTypeNames[op]
+          << "\": {\"count\": " << h.count()
+          << ", \"p50\": " << h.percentile(0.5)
+          << ", \"p99\": " << h.percentile(0.99)
+          << ", \"p999\": " << h.percentile(0.999)
+          << ", \"max\": " << h.max() << "}";
+    }
+    out << "}, \"perf_per_op\": {";
+    bool first = true;
+    for (int e = 0; e < PerfCounters::NrEvents; ++e) {
+      if (r.perfAvailable[e]) {
+        out << (first ? "" : ", ") << "\"" << PerfCounters::name(e)
+            << "\": " << r.perfPerOp[e];
+        first = false;
+      }
+    }
+    out << "}}";
+  }
+  out << "\n]\n";
+}
+
+// Runs the workload on every map type in maps with every thread count in
+// threadCounts and appends the results. Only the very first run records.
+template <class TestMap>
+void runAll(Workload const& w, std::vector<int> const& maps,
+            std::vector<unsigned> const& threadCounts, unsigned nInitialSize,
+            uint32_t nShards, std::vector<TraceRecord>* record,
+            std::vector<RunResult>& results) {
+  for (int m : maps) {
+    double single = 0.0;
+    for (unsigned t : threadCounts) {
+      results.emplace_back();
+      RunResult& r = results.back();
+      runTimed<TestMap>(w, m, nInitialSize, nShards, t, r,
+                        results.size() == 1 ? record : nullptr);
+      if (t == 1) {
+        single = r.opsPerSecond;
+      }
+      r.efficiency = r.opsPerSecond / (single * t);
+      std::cout << std::left << std::setw(10) << r.map << std::setw(6)
+                << r.keySize << std::setw(6) << r.valueSize << std::setw(10)
+                << t << std::setw(16) << std::fixed << std::setprecision(0)
+                << r.opsPerSecond << std::setprecision(3) << r.efficiency
+                << std::endl;
+      if (w.perf) {
+        printPerf(r);
+      }
+      if (w.latency) {
+        printLatencies(r);
+      }
+      if (w.stats && m == 1) {
+        printStats(r.stats);
+      }
+    }
+  }
+}
+
+// Selects the compiled-in instantiation for the key and value size, see
+// keySizes and valueSizes:
+template <unsigned KeySize>
+void dispatchValueSize(unsigned valueSize, Workload const& w,
+                       std::vector<int> const& maps,
+                       std::vector<unsigned> const& threadCounts,
+                       unsigned nInitialSize, uint32_t nShards,
+                       std::vector<TraceRecord>* record,
+                       std::vector<RunResult>& results) {
+#define PERFORMANCE_TEST_VALUE_SIZE(size)                              \
+  case size:                                                           \
+    runAll<TestMap<KeySize, size>>(w, maps, threadCounts, nInitialSize, \
+                                   nShards, record, results);          \
+    break;
+  switch (valueSize) {
+    PERFORMANCE_TEST_VALUE_SIZE(0)
+    PERFORMANCE_TEST_VALUE_SIZE(4)
+    PERFORMANCE_TEST_VALUE_SIZE(8)
+    PERFORMANCE_TEST_VALUE_SIZE(16)
+    PERFORMANCE_TEST_VALUE_SIZE(32)
+    PERFORMANCE_TEST_VALUE_SIZE(64)
+    PERFORMANCE_TEST_VALUE_SIZE(128)
+    PERFORMANCE_TEST_VALUE_SIZE(256)
+    default:
+      break;
+  }
+#undef PERFORMANCE_TEST_VALUE_SIZE
+}
+
+void dispatch(unsigned keySize, unsigned valueSize, Workload const& w,
+              std::vector<int> const& maps,
+              std::vector<unsigned> const& threadCounts,
+              unsigned nInitialSize, uint32_t nShards,
+              std::vector<TraceRecord>* record,
+              std::vector<RunResult>& results) {
+  switch (keySize) {
+    case 4:
+      dispatchValueSize<4>(valueSize, w, maps, threadCounts, nInitialSize,
+                           nShards, record, results);
+      break;
+    case 8:
+      dispatchValueSize<8>(valueSize, w, maps, threadCounts, nInitialSize,
+                           nShards, record, results);
+      break;
+    case 16:
+      dispatchValueSize<16>(valueSize, w, maps, threadCounts, nInitialSize,
+                            nShards, record, results);
+      break;
+    case 32:
+      dispatchValueSize<32>(valueSize, w, maps, threadCounts, nInitialSize,
+                            nShards, record, results);
+      break;
+    case 64:
+      dispatchValueSize<64>(valueSize, w, maps, threadCounts, nInitialSize,
+                            nShards, record, results);
+      break;
+    default:
+      break;
+  }
+}
+
+// Parses a comma separated list of sizes, each of which must be one of
+// the n sizes in allowed, or "all" for all of them:
+bool parseSizes(char const* arg, unsigned const* allowed, size_t n,
+                std::vector<unsigned>& sizes) {
+  sizes.clear();
+  if (std::strcmp(arg, "all") == 0) {
+    sizes.assign(allowed, allowed + n);
+    return true;
+  }
+  while (*arg != 0) {
+    char* end;
+    unsigned long size = std::strtoul(arg, &end, 10);
+    if (end == arg || (*end != ',' && *end != 0) ||
+        std::find(allowed, allowed + n, size) == allowed + n) {
+      return false;
+    }
+    sizes.push_back(static_cast<unsigned>(size));
+    arg = (*end == ',') ? end + 1 : end;
+  }
+  return !sizes.empty();
+}
+
+// Usage: PerformanceTest [cuckoo] [nOpCount] [nInitialSize] [nMaxSize]
+//          [nWorking] [pInsert] [pLookup] [pRemove] [pWorking] [pMiss]
+//          [seed] [nThreads] [nShards]
+//    [cuckoo]: 1 = use ShardedMap<CuckooMap>; 0 = use std::unordered_map
+//              behind a mutex; 2 = run both for comparison
+//    [nOpCount]: Number of operations to run per thread
 //    [nInitialSize]: Initial number of elements
-//    [nMaxSize]: Maximum number of elements
-//    [nWorking]: Size of working set
+//    [nMaxSize]: Maximum number of elements per thread
+//    [nWorking]: Size of working set per thread
 //    [pInsert]: Probability of insert
 //    [pLookup]: Probability of lookup
 //    [pRemove]: Probability of remove
 //    [pWorking]: Probability of operation staying in working set
 //    [pMiss]: Probability of lookup for missing element
 //    [seed]: Seed for PRNG
+//    [nThreads]: Optional, maximal number of threads (default 1), the
+//                workload is run with 1, 2, 4, ... and nThreads threads
+//    [nShards]: Optional, number of shards of the ShardedMap (default 1)
+//  Options, which may appear anywhere on the command line:
+//    --latency: record and print latency percentiles per operation type
+//    --stats: print the statistics of the ShardedMap after every run
+//    --perf: count cycles, instructions, LLC misses, dTLB misses and
+//            branch misses with perf_event_open(2) in every thread and
+//            print them per operation
+//    --optimistic: look up with CuckooMap::lookupCopy, which does not
+//                  take the mutex (and does not promote)
+//    --csv=FILE: write results (including latencies) as CSV to FILE
+//    --json=FILE: write results (including latencies) as JSON to FILE
+//    --dist=NAME: key distribution of lookups, one of uniform (default,
+//                 uses nWorking and pWorking), zipfian, hotspot (as
+//                 uniform, but the hot set moves), scan or latest
+//    --theta=X: skew of zipfian and latest, 0 < X < 1 (default 0.99)
+//    --shift=N: hotspot moves every N operations (default 100000)
+//    --record=FILE: write the operations of the first thread of the first
+//                   run to FILE as a binary trace
+//    --trace=FILE: instead of generating operations, every thread replays
+//                  the binary trace in FILE once in its own key range,
+//                  [nOpCount], [pInsert] ... [pMiss] are then ignored
+//    --key-size=LIST: comma separated key sizes in bytes out of 4
+//                     (default), 8, 16, 32, 64, or "all"
+//    --value-size=LIST: comma separated value sizes in bytes out of 0, 4
+//                       (default), 8, 16, 32, 64, 128, 256, or "all"; the
+//                       workload runs for every combination
 int main(int argc, char* argv[]) {
-  if (argc < 12) {
+  bool latency = false;
+  bool stats = false;
+  bool perf = false;
+  bool optimistic = false;
+  std::string csvPath;
+  std::string jsonPath;
+  std::string recordPath;
+  std::string tracePath;
+  Distribution distribution = DistUniform;
+  double theta = 0.99;
+  unsigned shiftInterval = 100000;
+  std::vector<unsigned> keySizeList(1, 4);
+  std::vector<unsigned> valueSizeList(1, 4);
+  int nrPositional = 1;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--latency") == 0) {
+      latency = true;
+    } else if (std::strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (std::strcmp(argv[i], "--perf") == 0) {
+      perf = true;
+    } else if (std::strcmp(argv[i], "--optimistic") == 0) {
+      optimistic = true;
+    } else if (std::strncmp(argv[i], "--csv=", 6) == 0) {
+      csvPath = argv[i] + 6;
+      latency = true;
+    } else if (std::strncmp(argv[i], "--json=", 7) == 0) {
+      jsonPath = argv[i] + 7;
+      latency = true;
+    } else if (std::strncmp(argv[i], "--dist=", 7) == 0) {
+      int d = 0;
+      while (d < NrDistributions &&
+             std::strcmp(argv[i] + 7, distributionNames[d]) != 0) {
+        ++d;
+      }
+      if (d == NrDistributions) {
+        std::cerr << "Unknown distribution " << argv[i] + 7 << std::endl;
+        exit(-1);
+      }
+      distribution = static_cast<Distribution>(d);
+    } else if (std::strncmp(argv[i], "--theta=", 8) == 0) {
+      theta = atof(argv[i] + 8);
+    } else if (std::strncmp(argv[i], "--shift=", 8) == 0) {
+      shiftInterval = atoi(argv[i] + 8);
+    } else if (std::strncmp(argv[i], "--record=", 9) == 0) {
+      recordPath = argv[i] + 9;
+    } else if (std::strncmp(argv[i], "--trace=", 8) == 0) {
+      tracePath = argv[i] + 8;
+    } else if (std::strncmp(argv[i], "--key-size=", 11) == 0) {
+      if (!parseSizes(argv[i] + 11, keySizes,
+                      sizeof(keySizes) / sizeof(keySizes[0]), keySizeList)) {
+        std::cerr << "Invalid key sizes " << argv[i] + 11 << std::endl;
+        exit(-1);
+      }
+    } else if (std::strncmp(argv[i], "--value-size=", 13) == 0) {
+      if (!parseSizes(argv[i] + 13, valueSizes,
+                      sizeof(valueSizes) / sizeof(valueSizes[0]),
+                      valueSizeList)) {
+        std::cerr << "Invalid value sizes " << argv[i] + 13 << std::endl;
+        exit(-1);
+      }
+    } else if (std::strncmp(argv[i], "--", 2) == 0) {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      exit(-1);
+    } else {
+      argv[nrPositional++] = argv[i];
+    }
+  }
+  argc = nrPositional;
+
+  if (argc < 12 || argc > 14) {
     std::cerr << "Incorrect number of parameters." << std::endl;
     exit(-1);
   }
 
   unsigned useCuckoo = atoi(argv[1]);
-  unsigned nOpCount = atoi(argv[2]);
+  Workload w;
+  w.latency = latency;
+  w.stats = stats;
+  w.perf = perf;
+  w.optimistic = optimistic;
+  w.nOpCount = atoi(argv[2]);
   unsigned nInitialSize = atoi(argv[3]);
-  unsigned nMaxSize = atoi(argv[4]);
-  unsigned nWorking = atoi(argv[5]);
-  double pInsert = atof(argv[6]);
-  double pLookup = atof(argv[7]);
-  double pRemove = atof(argv[8]);
-  double pWorking = atof(argv[9]);
-  double pMiss = atof(argv[10]);
-  unsigned seed = atoi(argv[11]);
-
-  if (nInitialSize > nMaxSize || nWorking > nMaxSize) {
+  w.nMaxSize = atoi(argv[4]);
+  w.nWorking = atoi(argv[5]);
+  w.pInsert = atof(argv[6]);
+  w.pLookup = atof(argv[7]);
+  w.pRemove = atof(argv[8]);
+  w.pWorking = atof(argv[9]);
+  w.pMiss = atof(argv[10]);
+  w.seed = atoi(argv[11]);
+  w.distribution = distribution;
+  w.theta = theta;
+  w.shiftInterval = shiftInterval;
+  w.replay = nullptr;
+  unsigned nThreads = (argc > 12) ? atoi(argv[12]) : 1;
+  unsigned nShards = (argc > 13) ? atoi(argv[13]) : 1;
+
+  if (nInitialSize > w.nMaxSize || w.nWorking > w.nMaxSize) {
     std::cerr << "Invalid initial/total/working numbers." << std::endl;
     exit(-1);
   }
 
-  if (pWorking < 0.0 || pWorking > 1.0) {
+  if (w.pWorking < 0.0 || w.pWorking > 1.0) {
     std::cerr << "Keep 0 < pWorking < 1." << std::endl;
     exit(-1);
   }
 
-  if (pMiss < 0.0 || pMiss > 1.0) {
+  if (w.pMiss < 0.0 || w.pMiss > 1.0) {
     std::cerr << "Keep 0 < pMiss < 1." << std::endl;
     exit(-1);
   }
 
-  RandomNumber r(seed);
-
-  std::vector<double> opWeights;
-  opWeights.push_back(pInsert);
-  opWeights.push_back(pLookup);
-  opWeights.push_back(pRemove);
-  WeightedSelector operations(seed, opWeights);
-
-  std::vector<double> workingWeights;
-  workingWeights.push_back(1.0 - pWorking);
-  workingWeights.push_back(pWorking);
-  WeightedSelector working(seed, workingWeights);
-
-  std::vector<double> missWeights;
-  missWeights.push_back(1.0 - pMiss);
-  missWeights.push_back(pMiss);
-  WeightedSelector miss(seed, missWeights);
-
-  TestMap map(useCuckoo, nInitialSize);
-  unsigned minElement = 0;
-  unsigned maxElement = 0;
-  unsigned opCode;
-  unsigned current;
-  unsigned barrier, nHot, nCold;
-  bool success;
-  Key* k;
-  Value* v;
-  for (unsigned i = 0; i < nOpCount; i++) {
-    opCode = operations.next();
-
-    switch (opCode) {
-      case 0:
-        // insert if allowed
-        if (maxElement - minElement >= nMaxSize) {
-          break;
-        }
+  if (useCuckoo > 2 || nThreads == 0 || nShards == 0) {
+    std::cerr << "Invalid map type, thread or shard count." << std::endl;
+    exit(-1);
+  }
 
-        current = maxElement++;
-        k = new Key(current);
-        v = new Value(current);
-        success = map.insert(*k, v);
-        if (!success) {
-          std::cout << "Failed to insert " << current << std::endl;
-          exit(-1);
-        } else {
-          // std::cout << "Inserted " << current << std::endl;
-        }
-        delete k;
-        delete v;
-        break;
-      case 1:
-        // lookup
-        barrier = MIN(minElement + nWorking, maxElement);
-        nHot = barrier - minElement;
-        nCold = maxElement - barrier;
-        if (miss.next()) {
-          current = maxElement + r.next();
-        } else if (working.next()) {
-          current = minElement + r.nextInRange(nHot);
-        } else {
-          current = nCold ? barrier + r.nextInRange(nCold)
-                          : minElement + r.nextInRange(nHot);
-        }
+  if (static_cast<uint64_t>(w.nOpCount) + w.nMaxSize >=
+      0x7ffffffeu / nThreads) {
+    std::cerr << "Too many operations for the per-thread key ranges."
+              << std::endl;
+    exit(-1);
+  }
 
-        k = new Key(current);
-        v = map.lookup(current);
-        /*if (v == nullptr) {
-          std::cout << "Failed to find " << current << std::endl;
-        } else {
-          std::cout << "Found " << current << std::endl;
-        }*/
-        delete k;
-        break;
-      case 2:
-        // remove if allowed
-        if (minElement >= maxElement) {
-          break;
-        }
-        current = working.next() ? minElement++ : maxElement--;
-
-        k = new Key(current);
-        success = map.remove(current);
-        if (!success) {
-          std::cout << "Failed to remove " << current << std::endl;
-          exit(-1);
-        } else {
-          // std::cout << "Removed " << current << std::endl;
-        }
-        delete k;
-        break;
-      default:
-        break;
+  if (theta <= 0.0 || theta >= 1.0 || shiftInterval == 0) {
+    std::cerr << "Keep 0 < theta < 1 and shift > 0." << std::endl;
+    exit(-1);
+  }
+
+  if (perf) {
+    PerfCounters probe;
+    if (!probe.available()) {
+      std::cerr << "Hardware counters unavailable (" << probe.error()
+                << "), reporting times only." << std::endl;
+      w.perf = false;
     }
   }
 
-  // std::cout << "Done." << std::endl;
+  std::vector<TraceRecord> trace;
+  if (!tracePath.empty()) {
+    if (!readTrace(tracePath, trace)) {
+      std::cerr << "Cannot read trace " << tracePath << std::endl;
+      exit(-1);
+    }
+    for (TraceRecord const& r : trace) {
+      if (r.key >= 0x7ffffffeu / nThreads) {
+        std::cerr << "Trace key " << r.key << " exceeds the per-thread key "
+                  << "range." << std::endl;
+        exit(-1);
+      }
+    }
+    w.replay = &trace;
+  }
+  std::vector<TraceRecord> recorded;
+
+  std::vector<unsigned> threadCounts;
+  for (unsigned t = 1; t < nThreads; t <<= 1) {
+    threadCounts.push_back(t);
+  }
+  threadCounts.push_back(nThreads);
+
+  std::vector<int> maps;
+  if (useCuckoo != 1) {
+    maps.push_back(0);
+  }
+  if (useCuckoo != 0) {
+    maps.push_back(1);
+  }
+
+  std::cout << std::left << std::setw(10) << "map" << std::setw(6) << "key"
+            << std::setw(6) << "value" << std::setw(10) << "threads"
+            << std::setw(16) << "ops/s" << "efficiency" << std::endl;
+  std::vector<RunResult> results;
+  for (unsigned keySize : keySizeList) {
+    for (unsigned valueSize : valueSizeList) {
+      dispatch(keySize, valueSize, w, maps, threadCounts, nInitialSize,
+               nShards, recordPath.empty() ? nullptr : &recorded, results);
+    }
+  }
+
+  if (!recordPath.empty() && !writeTrace(recordPath, recorded)) {
+    std::cerr << "Cannot write trace " << recordPath << std::endl;
+    exit(-1);
+  }
+  if (!csvPath.empty()) {
+    writeCsv(csvPath, results);
+  }
+  if (!jsonPath.empty()) {
+    writeJson(jsonPath, results);
+  }
 
   exit(0);
 }
@@ -1,6 +1,7 @@
 #include <cassert>
 #include <iostream>
 
+#include <cuckoomap/CuckooHashes.h>
 #include <cuckoomap/CuckooMap.h>
 #include <cuckoomap/ShardedMap.h>
 
@@ -44,6 +45,7 @@ int main(int argc, char* argv[]) {
   auto show = [&]() {
     for (int i = 99; i >= 1; --i) {
       Key k(i);
+      m.prefetch(Key(i - 1));
       auto f = m.lookup(k);
       if (f.found()) {
         std::cout << "Found key " << i << " with value " << f.value()->v
@@ -66,9 +68,104 @@ int main(int argc, char* argv[]) {
       }
     }
   };
+  auto stats = [&]() {
+    ShardedMapStats s = m.stats();
+    std::cout << s.total;
+    assert(s.shards.size() == 8);
+    assert(s.total.nrUsed == m.nrUsed());
+    assert(m.memoryUsage() > s.total.memoryUsage);
+    uint64_t inserts = 0;
+    for (auto const& shard : s.shards) {
+      std::cout << "shard: " << shard.lookups << " lookups, " << shard.inserts
+                << " inserts, " << shard.removes << " removes" << std::endl;
+      inserts += shard.inserts;
+    }
+#if CUCKOO_MAP_STATISTICS
+    assert(inserts == 99);
+#endif
+  };
+  auto readModifyWrite = [&]() {
+    Value v(1);
+    auto add = [](Value* a, Value const* b) { a->v += b->v; };
+    if (!m.upsert(Key(1000), &v, add)) {
+      assert(false);
+    }
+    if (m.upsert(Key(1000), &v, add) || m.insertOrAssign(Key(1000), &v) ||
+        m.tryEmplace(Key(1000), 3) ||
+        m.computeIfAbsent(Key(1000), [](Value*) {})) {
+      assert(false);
+    }
+    int seen = 0;
+    m.visit(Key(1000), [&seen](Value const* w) { seen = w->v; });
+    int previous = 0;
+    if (!m.fetchAdd(Key(1000), &Value::v, 2, &previous)) {
+      assert(false);
+    }
+    int expected = 3;
+    if (!m.compareExchange(Key(1000), &Value::v, expected, 0)) {
+      assert(false);
+    }
+    if (!m.remove(Key(1000))) {
+      assert(false);
+    }
+    assert(seen == 1 && previous == 1);
+  };
+  auto byHash = [&]() {
+    // The caller has one hash of its own for each key:
+    typedef HashWithSeed<Key, 0x1234567812345678ULL> OwnHash;
+    OwnHash ownHash;
+    ShardedMap<CuckooMap<Key, Value, SplitHash1<OwnHash>, SplitHash2<OwnHash>>>
+        hm(16, 4);
+    for (int i = 1; i < 500; ++i) {
+      Value v(i);
+      if (!hm.insertByHash(Key(i), &v, CuckooHashPair(ownHash(Key(i))))) {
+        assert(false);
+      }
+    }
+    for (int i = 1; i < 500; ++i) {
+      CuckooHashPair hash(ownHash(Key(i)));
+      {
+        auto f = hm.lookupByHash(Key(i), hash);
+        assert(f.found() == 1 && f.value()->v == i);
+      }
+      auto f = hm.lookup(Key(i));  // the same shard and buckets
+      assert(f.found() == 1 && f.value()->v == i);
+    }
+    for (int i = 1; i < 500; i += 2) {
+      if (!hm.removeByHash(Key(i), CuckooHashPair(ownHash(Key(i))))) {
+        assert(false);
+      }
+    }
+    assert(hm.nrUsed() == 249);
+  };
+  auto batch = [&]() {
+    ShardedMap<CuckooMap<Key, Value, BatchHash<Key, 1>, BatchHash<Key, 2>>>
+        bm(16, 4);
+    Key keys[100];
+    Value values[100];
+    bool found[100];
+    for (int i = 0; i < 100; ++i) {
+      keys[i] = Key(i + 1);
+      if (i % 3 != 0) {
+        Value v(i + 1);
+        bm.insert(keys[i], &v);
+      }
+    }
+    size_t hits = bm.lookupCopyBatch(keys, 100, values, found);
+    assert(hits == 66);
+    for (int i = 0; i < 100; ++i) {
+      assert(found[i] == (i % 3 != 0));
+      assert(!found[i] || values[i].v == i + 1);
+    }
+    (void)hits;
+  };
   std::cout << "map was made" << std::endl;
   insert();
   show();
   remove();
   show();
+  stats();
+  readModifyWrite();
+  byHash();
+  batch();
 }
@@ -0,0 +1,139 @@
+#ifndef WORKLOAD_GENERATORS_H
+#define WORKLOAD_GENERATORS_H 1
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Zipfian distributed ranks in [0, n) as in YCSB (after Gray et al.,
+// "Quickly Generating Billion-Record Synthetic Databases"), rank 0 being
+// the most popular. The normalization constant zeta(n, theta) is only
+// summed exactly for the first few terms and approximated with the
+// Euler-Maclaurin formula beyond, so that n may change between draws at
+// O(1) cost. theta must be in (0, 1).
+
+class ZipfianGenerator {
+  static constexpr uint64_t ExactTerms = 16;
+
+ public:
+  ZipfianGenerator(double theta)
+      : _theta(theta),
+        _alpha(1.0 / (1.0 - theta)),
+        _n(0),
+        _zetan(0.0),
+        _eta(0.0) {
+    _zeta2 = 1.0 + std::pow(0.5, theta);
+    _exactSum = 0.0;
+    for (uint64_t i = 1; i < ExactTerms; ++i) {
+      _exactSum += std::pow(static_cast<double>(i), -theta);
+    }
+  }
+
+  // u must be uniformly distributed in (0, 1]:
+  uint64_t next(uint64_t n, double u) {
+    if (n <= 1) {
+      return 0;
+    }
+    if (n != _n) {
+      setItemCount(n);
+    }
+    double uz = u * _zetan;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < _zeta2) {
+      return 1;
+    }
+    uint64_t rank = static_cast<uint64_t>(
+        n * std::pow(_eta * u - _eta + 1.0, _alpha));
+    return rank < n ? rank : n - 1;
+  }
+
+ private:
+  double zeta(uint64_t n) const {
+    if (n < ExactTerms) {
+      double sum = 0.0;
+      for (uint64_t i = 1; i <= n; ++i) {
+        sum += std::pow(static_cast<double>(i), -_theta);
+      }
+      return sum;
+    }
+    double m = static_cast<double>(ExactTerms);
+    double x = static_cast<double>(n);
+    return _exactSum +
+           (std::pow(x, 1.0 - _theta) - std::pow(m, 1.0 - _theta)) /
+               (1.0 - _theta) +
+           0.5 * (std::pow(m, -_theta) + std::pow(x, -_theta)) +
+           _theta / 12.0 *
+               (std::pow(m, -_theta - 1.0) - std::pow(x, -_theta - 1.0));
+  }
+
+  void setItemCount(uint64_t n) {
+    _n = n;
+    _zetan = zeta(n);
+    _eta = (1.0 - std::pow(2.0 / n, 1.0 - _theta)) / (1.0 - _zeta2 / _zetan);
+  }
+
+  double _theta;
+  double _alpha;     // 1 / (1 - theta)
+  double _zeta2;     // zeta(2, theta)
+  double _exactSum;  // sum of i^-theta for i in [1, ExactTerms)
+  uint64_t _n;       // item count for which _zetan and _eta are valid
+  double _zetan;
+  double _eta;
+};
+
+// FNV-1a on the 8 bytes of x, used to scatter Zipfian ranks over the key
+// space as YCSB's "scrambled zipfian" does:
+inline uint64_t scrambleRank(uint64_t x) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < 8; ++i) {
+    h ^= x & 0xff;
+    h *= 0x100000001b3ULL;
+    x >>= 8;
+  }
+  return h;
+}
+
+// Binary operation traces: an 8 byte magic followed by fixed size records
+// in host byte order. Keys are relative to the key range of the thread
+// that replays the trace.
+
+struct TraceRecord {
+  uint32_t op;  // 0 = insert, 1 = lookup, 2 = remove
+  uint32_t key;
+};
+
+static char const traceMagic[8] = {'C', 'M', 'T', 'R', 'A', 'C', 'E', '1'};
+
+inline bool readTrace(std::string const& path,
+                      std::vector<TraceRecord>& trace) {
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(traceMagic)];
+  if (!in.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, traceMagic, sizeof(magic)) != 0) {
+    return false;
+  }
+  TraceRecord record;
+  while (in.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+    if (record.op > 2) {
+      return false;
+    }
+    trace.push_back(record);
+  }
+  return in.eof();
+}
+
+inline bool writeTrace(std::string const& path,
+                       std::vector<TraceRecord> const& trace) {
+  std::ofstream out(path, std::ios::binary);
+  out.write(traceMagic, sizeof(traceMagic));
+  out.write(reinterpret_cast<char const*>(trace.data()),
+            trace.size() * sizeof(TraceRecord));
+  return static_cast<bool>(out);
+}
+
+#endif